@@ -18,6 +18,7 @@
 #include <grecs.h>
 #include <pwd.h>
 #include <grp.h>
+#include <ctype.h>
 
 envop_t *direvent_envop;
 
@@ -152,6 +153,12 @@ struct eventconf {
 	struct grecs_list *pathlist;
 	event_mask ev_mask;
 	filpatlist_t fpat;
+	filpatlist_t tpat;
+	filpatlist_t xpat;
+	int poll;
+	int digest;
+	int changed_content_only;
+	struct attrfilter filter;
 	struct prog_handler prog_handler;
 };
 
@@ -161,7 +168,9 @@ static void
 eventconf_init(void)
 {
 	memset(&eventconf, 0, sizeof eventconf);
+	attrfilter_init(&eventconf.filter);
 	eventconf.prog_handler.timeout = DEFAULT_TIMEOUT;
+	eventconf.prog_handler.output_grace = DEFAULT_OUTPUT_GRACE;
 }
 
 static void
@@ -170,33 +179,45 @@ eventconf_free(void)
 	grecs_list_free(eventconf.pathlist);
 	prog_handler_free(&eventconf.prog_handler);
 	filpatlist_destroy(&eventconf.fpat);
+	filpatlist_destroy(&eventconf.tpat);
+	filpatlist_destroy(&eventconf.xpat);
+	attrfilter_free(&eventconf.filter);
 }
 
 void
 eventconf_flush(grecs_locus_t *loc)
 {
 	struct grecs_list_entry *ep;
-	struct handler *hp = prog_handler_alloc(eventconf.ev_mask,
-						eventconf.fpat,
-						&eventconf.prog_handler);
-
+	struct handler *hp;
+	size_t len;
+
+	/* Latency statistics are kept per watcher, identified by its
+	   location in the configuration */
+	len = strlen(loc->beg.file) + 24;
+	eventconf.prog_handler.name = emalloc(len);
+	snprintf(eventconf.prog_handler.name, len, "%s:%u",
+		 loc->beg.file, loc->beg.line);
+	hp = prog_handler_alloc(eventconf.ev_mask, eventconf.fpat,
+				&eventconf.prog_handler);
+
+	hp->tnames = eventconf.tpat;
+	hp->xnames = eventconf.xpat;
+	hp->poll = eventconf.poll;
+	if (eventconf.digest)
+		hp->digest |= HD_DIGEST;
+	if (eventconf.changed_content_only)
+		hp->digest |= HD_DIGEST | HD_CHANGED;
+	if (!attrfilter_is_empty(&eventconf.filter)) {
+		hp->filter = emalloc(sizeof(*hp->filter));
+		*hp->filter = eventconf.filter;
+	}
 	for (ep = eventconf.pathlist->head; ep; ep = ep->next) {
 		struct pathent *pe = ep->data;
-		struct watchpoint *wpt;
-		int isnew;
 		
-		wpt = watchpoint_install(pe->path, &isnew);
-		if (!wpt)
-			abort();
-		if (isnew) {
-			wpt->depth = pe->depth;
-			if (USE_IFACE == IFACE_KQUEUE || wpt->depth)
-				watchpoint_attach_directory_sentinel(wpt);
-		} else if (wpt->depth != pe->depth)
+		if (watchconf_add(pe->path, pe->depth, hp))
 			grecs_error(loc, 0,
 				    _("%s: recursion depth does not match previous definition"),
 				    pe->path);
-		handler_list_append(wpt->handler_list, hp);
 	}
 	grecs_list_free(eventconf.pathlist);
 	eventconf_init();
@@ -300,6 +321,11 @@ cb_path(enum grecs_callback_command cmd, grecs_node_t *node,
 		grecs_error(locus, 0, _("unexpected list"));
 		return 1;
 	}
+	if (is_glob_pattern(s) && s[0] != '/') {
+		grecs_error(locus, 0,
+			    _("wildcards are allowed only in absolute pathnames"));
+		return 1;
+	}
 	pe = pathent_alloc(s, depth);
         if (*lpp)
 		lp = *lpp;
@@ -475,6 +501,24 @@ cb_user(enum grecs_callback_command cmd, grecs_node_t *node,
 	return 0;
 }
 
+static int
+cb_backend(enum grecs_callback_command cmd, grecs_node_t *node,
+	   void *varptr, void *cb_data)
+{
+	grecs_value_t *val = node->v.value;
+
+	ASSERT_SCALAR(cmd, &node->locus);
+	if (assert_grecs_value_type(&val->locus, val, GRECS_TYPE_STRING))
+		return 1;
+	if (strcmp(val->v.string, "kernel") == 0)
+		eventconf.poll = 0;
+	else if (strcmp(val->v.string, "poll") == 0)
+		eventconf.poll = 1;
+	else
+		grecs_error(&val->locus, 0, _("unrecognized backend"));
+	return 0;
+}
+
 static int
 cb_option(enum grecs_callback_command cmd, grecs_node_t *node,
 	  void *varptr, void *cb_data)
@@ -826,6 +870,254 @@ cb_file_pattern(enum grecs_callback_command cmd, grecs_node_t *node,
 	return 0;
 }
 
+/*
+ * Call FN for each element of VAL, which can be a single string, an
+ * array or a list.
+ */
+static int
+config_value_foreach(grecs_value_t *val,
+		     int (*fn)(grecs_value_t *, void *), void *data)
+{
+	struct grecs_list_entry *ep;
+	int i;
+
+	switch (val->type) {
+	case GRECS_TYPE_STRING:
+		return fn(val, data);
+
+	case GRECS_TYPE_ARRAY:
+		for (i = 0; i < val->v.arg.c; i++)
+			if (fn(val->v.arg.v[i], data))
+				return 1;
+		break;
+
+	case GRECS_TYPE_LIST:
+		for (ep = val->v.list->head; ep; ep = ep->next)
+			if (fn((grecs_value_t *) ep->data, data))
+				return 1;
+		break;
+	}
+	return 0;
+}
+
+static struct transtab kwftype[] = {
+	{ "regular",   FT_REG },
+	{ "directory", FT_DIR },
+	{ "symlink",   FT_LNK },
+	{ "fifo",      FT_FIFO },
+	{ "socket",    FT_SOCK },
+	{ "char",      FT_CHR },
+	{ "block",     FT_BLK },
+	{ NULL }
+};
+
+static int
+file_type_add(grecs_value_t *val, void *data)
+{
+	int *types = data;
+	int t;
+
+	if (assert_grecs_value_type(&val->locus, val, GRECS_TYPE_STRING))
+		return 1;
+	if (trans_strtotok(kwftype, val->v.string, &t)) {
+		grecs_error(&val->locus, 0, _("unknown file type `%s'"),
+			    val->v.string);
+		return 1;
+	}
+	*types |= t;
+	return 0;
+}
+
+static int
+cb_file_type(enum grecs_callback_command cmd, grecs_node_t *node,
+	     void *varptr, void *cb_data)
+{
+	ASSERT_SCALAR(cmd, &node->locus);
+	config_value_foreach(node->v.value, file_type_add, varptr);
+	return 0;
+}
+
+/* Convert the string S to a number.  Return 0 on success. */
+static int
+config_strtoul(char const *s, int base, unsigned long *ret)
+{
+	char *end;
+
+	errno = 0;
+	*ret = strtoul(s, &end, base);
+	return errno || *s == 0 || *end != 0;
+}
+
+static int
+owner_add(grecs_value_t *val, void *data)
+{
+	struct attrfilter *af = data;
+	struct passwd *pw;
+	unsigned long n;
+
+	if (assert_grecs_value_type(&val->locus, val, GRECS_TYPE_STRING))
+		return 1;
+	if ((pw = getpwnam(val->v.string)) != NULL)
+		n = pw->pw_uid;
+	else if (config_strtoul(val->v.string, 10, &n)) {
+		grecs_error(&val->locus, 0, _("no such user"));
+		return 1;
+	}
+	af->uidv = erealloc(af->uidv, (af->uidc + 1) * sizeof(af->uidv[0]));
+	af->uidv[af->uidc++] = n;
+	return 0;
+}
+
+static int
+cb_owner(enum grecs_callback_command cmd, grecs_node_t *node,
+	 void *varptr, void *cb_data)
+{
+	ASSERT_SCALAR(cmd, &node->locus);
+	config_value_foreach(node->v.value, owner_add, varptr);
+	return 0;
+}
+
+static int
+group_add(grecs_value_t *val, void *data)
+{
+	struct attrfilter *af = data;
+	struct group *gr;
+	unsigned long n;
+
+	if (assert_grecs_value_type(&val->locus, val, GRECS_TYPE_STRING))
+		return 1;
+	if ((gr = getgrnam(val->v.string)) != NULL)
+		n = gr->gr_gid;
+	else if (config_strtoul(val->v.string, 10, &n)) {
+		grecs_error(&val->locus, 0, _("no such group"));
+		return 1;
+	}
+	af->gidv = erealloc(af->gidv, (af->gidc + 1) * sizeof(af->gidv[0]));
+	af->gidv[af->gidc++] = n;
+	return 0;
+}
+
+static int
+cb_group(enum grecs_callback_command cmd, grecs_node_t *node,
+	 void *varptr, void *cb_data)
+{
+	ASSERT_SCALAR(cmd, &node->locus);
+	config_value_foreach(node->v.value, group_add, varptr);
+	return 0;
+}
+
+/* Well-known content signatures */
+static struct {
+	char const *name;
+	char const *bytes;
+	size_t len;
+} kwsignature[] = {
+	{ "gzip",    "\x1f\x8b", 2 },
+	{ "bzip2",   "BZh", 3 },
+	{ "xz",      "\xfd" "7zXZ\0", 6 },
+	{ "zstd",    "\x28\xb5\x2f\xfd", 4 },
+	{ "zip",     "PK\x03\x04", 4 },
+	{ "pdf",     "%PDF-", 5 },
+	{ "png",     "\x89PNG\r\n\x1a\n", 8 },
+	{ "jpeg",    "\xff\xd8\xff", 3 },
+	{ "gif",     "GIF8", 4 },
+	{ "parquet", "PAR1", 4 },
+	{ "elf",     "\x7f" "ELF", 4 },
+	{ NULL }
+};
+
+static int
+xdigit_value(int c)
+{
+	if (isdigit(c))
+		return c - '0';
+	return tolower(c) - 'a' + 10;
+}
+
+/*
+ * Parse the content signature in VAL.  It is either the name of a
+ * well-known signature, or the prefix "hex:" followed by the bytes in
+ * hex, or literal text.
+ */
+static int
+signature_add(grecs_value_t *val, void *data)
+{
+	struct attrfilter *af = data;
+	struct signature sig;
+	char const *s;
+	int i;
+
+	if (assert_grecs_value_type(&val->locus, val, GRECS_TYPE_STRING))
+		return 1;
+	s = val->v.string;
+	for (i = 0; kwsignature[i].name; i++)
+		if (strcmp(kwsignature[i].name, s) == 0)
+			break;
+	if (kwsignature[i].name) {
+		sig.len = kwsignature[i].len;
+		memcpy(sig.bytes, kwsignature[i].bytes, sig.len);
+	} else if (strncmp(s, "hex:", 4) == 0) {
+		size_t n;
+
+		s += 4;
+		for (n = 0; isxdigit((unsigned char) s[n]); n++)
+			;
+		if (s[n] || n % 2) {
+			grecs_error(&val->locus, 0,
+				    _("malformed hex signature"));
+			return 1;
+		}
+		sig.len = n / 2;
+		for (n = 0; n < sig.len && n < CONTENT_PREFIX_MAX; n++)
+			sig.bytes[n] = (xdigit_value(s[2*n]) << 4)
+				       | xdigit_value(s[2*n+1]);
+	} else {
+		sig.len = strlen(s);
+		if (sig.len <= CONTENT_PREFIX_MAX)
+			memcpy(sig.bytes, s, sig.len);
+	}
+	if (sig.len == 0) {
+		grecs_error(&val->locus, 0, _("empty signature"));
+		return 1;
+	}
+	if (sig.len > CONTENT_PREFIX_MAX) {
+		grecs_error(&val->locus, 0,
+			    _("signature too long (max. %d bytes)"),
+			    CONTENT_PREFIX_MAX);
+		return 1;
+	}
+	af->sigv = erealloc(af->sigv, (af->sigc + 1) * sizeof(af->sigv[0]));
+	af->sigv[af->sigc++] = sig;
+	return 0;
+}
+
+static int
+cb_content(enum grecs_callback_command cmd, grecs_node_t *node,
+	   void *varptr, void *cb_data)
+{
+	ASSERT_SCALAR(cmd, &node->locus);
+	config_value_foreach(node->v.value, signature_add, varptr);
+	return 0;
+}
+
+static int
+cb_mode(enum grecs_callback_command cmd, grecs_node_t *node,
+	void *varptr, void *cb_data)
+{
+	grecs_value_t *val = node->v.value;
+	unsigned long n;
+
+	ASSERT_SCALAR(cmd, &node->locus);
+	if (assert_grecs_value_type(&val->locus, val, GRECS_TYPE_STRING))
+		return 1;
+	if (config_strtoul(val->v.string, 8, &n) || n > 07777) {
+		grecs_error(&val->locus, 0, _("invalid file mode"));
+		return 1;
+	}
+	*(unsigned long*)varptr = n;
+	return 0;
+}
+
 static struct grecs_keyword watcher_kw[] = {
 	{ "path", NULL, N_("Pathname to watch"),
 	  grecs_type_string, GRECS_DFLT, &eventconf.pathlist, 0,
@@ -836,6 +1128,75 @@ static struct grecs_keyword watcher_kw[] = {
 	{ "file", N_("regexp"), N_("Files to watch for"),
 	  grecs_type_string, GRECS_LIST, &eventconf.fpat, 0,
 	  cb_file_pattern },
+	{ "temp-file", N_("regexp"),
+	  N_("Names of temporary files: their events are ignored, and "
+	     "renaming one to a regular name is reported as a change"),
+	  grecs_type_string, GRECS_LIST, &eventconf.tpat, 0,
+	  cb_file_pattern },
+	{ "exclude", N_("regexp"),
+	  N_("Subdirectories not to watch recursively"),
+	  grecs_type_string, GRECS_LIST, &eventconf.xpat, 0,
+	  cb_file_pattern },
+	{ "output", N_("regexp"),
+	  N_("Names of the files written by the command: their events "
+	     "are ignored while it runs"),
+	  grecs_type_string, GRECS_LIST, &eventconf.prog_handler.onames, 0,
+	  cb_file_pattern },
+	{ "output-grace", N_("seconds"),
+	  N_("Keep ignoring events on output files for this many seconds "
+	     "after the command exits"),
+	  grecs_type_uint, GRECS_DFLT, &eventconf.prog_handler.output_grace },
+	{ "type", N_("type"),
+	  N_("Run the command only for files of these types: regular, "
+	     "directory, symlink, fifo, socket, char or block"),
+	  grecs_type_string, GRECS_LIST, &eventconf.filter.types, 0,
+	  cb_file_type },
+	{ "min-size", N_("n"),
+	  N_("Run the command only for files of at least this many bytes"),
+	  grecs_type_size, GRECS_DFLT, &eventconf.filter.min_size },
+	{ "max-size", N_("n"),
+	  N_("Run the command only for files of at most this many bytes"),
+	  grecs_type_size, GRECS_DFLT, &eventconf.filter.max_size },
+	{ "owner", N_("user"),
+	  N_("Run the command only for files owned by one of these users"),
+	  grecs_type_string, GRECS_LIST, &eventconf.filter, 0,
+	  cb_owner },
+	{ "group", N_("group"),
+	  N_("Run the command only for files owned by one of these "
+	     "groups"),
+	  grecs_type_string, GRECS_LIST, &eventconf.filter, 0,
+	  cb_group },
+	{ "mode", N_("octal"),
+	  N_("Run the command only for files that have all these mode "
+	     "bits set"),
+	  grecs_type_string, GRECS_DFLT, &eventconf.filter.mode, 0,
+	  cb_mode },
+	{ "min-age", N_("seconds"),
+	  N_("Run the command only for files modified at least this many "
+	     "seconds ago"),
+	  grecs_type_uint, GRECS_DFLT, &eventconf.filter.min_age },
+	{ "max-age", N_("seconds"),
+	  N_("Run the command only for files modified at most this many "
+	     "seconds ago"),
+	  grecs_type_uint, GRECS_DFLT, &eventconf.filter.max_age },
+	{ "digest", NULL,
+	  N_("Compute the content digest of changed files and pass it to "
+	     "the command"),
+	  grecs_type_bool, GRECS_DFLT, &eventconf.digest },
+	{ "changed-content-only", NULL,
+	  N_("Don't run the command if a change left the file content "
+	     "as it was"),
+	  grecs_type_bool, GRECS_DFLT, &eventconf.changed_content_only },
+	{ "content", N_("signature"),
+	  N_("Run the command only for files that begin with one of these "
+	     "signatures"),
+	  grecs_type_string, GRECS_LIST, &eventconf.filter, 0,
+	  cb_content },
+	{ "backend", N_("kernel|poll"),
+	  N_("How to watch: by kernel notifications (default) or by "
+	     "polling"),
+	  grecs_type_string, GRECS_DFLT, NULL, 0,
+	  cb_backend },
 	{ "command", NULL, N_("Command to execute on event"),
 	  grecs_type_string, GRECS_DFLT, &eventconf.prog_handler.command },
 	{ "user", N_("name"), N_("Run command as this user"),
@@ -869,6 +1230,52 @@ static struct grecs_keyword direvent_kw[] = {
 	  grecs_type_section, GRECS_DFLT, NULL, 0, NULL, NULL, syslog_kw },
 	{ "debug", N_("level"), N_("Set debug level"),
 	  grecs_type_int, GRECS_DFLT, &debug_level },
+	{ "trace-file", N_("file"),
+	  N_("Write handler latency trace to this file"),
+	  grecs_type_string, GRECS_DFLT, &trace_file },
+	{ "journal", N_("file"),
+	  N_("Record handler runs in this file and replay unfinished "
+	     "ones at startup"),
+	  grecs_type_string, GRECS_DFLT, &journal_file },
+	{ "snapshot", N_("file"),
+	  N_("Save the state of watched directories to this file on "
+	     "exit and report changes made while not running"),
+	  grecs_type_string, GRECS_DFLT, &snapshot_file },
+	{ "change-table-size", N_("n"),
+	  N_("Track at most this many files changed but not yet closed"),
+	  grecs_type_size, GRECS_DFLT, &change_max },
+	{ "digest-cache-size", N_("n"),
+	  N_("Remember the content digests of at most this many files"),
+	  grecs_type_size, GRECS_DFLT, &digest_cache_size },
+	{ "change-ttl", N_("n"),
+	  N_("Forget about a changed file if it is not closed within this "
+	     "many seconds"),
+	  grecs_type_uint, GRECS_DFLT, &change_ttl },
+	{ "recent-ttl", N_("n"),
+	  N_("Remember names reported in a new directory for this many "
+	     "seconds"),
+	  grecs_type_uint, GRECS_DFLT, &recent_ttl },
+	{ "watch-budget", N_("n"),
+	  N_("Use at most this many kernel watches; poll the rest"),
+	  grecs_type_size, GRECS_DFLT, &watch_budget },
+	{ "poll-interval", N_("n"),
+	  N_("Scan polled directories that change every n seconds"),
+	  grecs_type_uint, GRECS_DFLT, &poll_interval },
+	{ "poll-max-interval", N_("n"),
+	  N_("Scan polled directories that do not change at most n "
+	     "seconds apart"),
+	  grecs_type_uint, GRECS_DFLT, &poll_max_interval },
+	{ "poll-budget", N_("n"),
+	  N_("Examine at most this many directory entries per second "
+	     "when polling"),
+	  grecs_type_size, GRECS_DFLT, &poll_budget },
+	{ "scan-slice", N_("n"),
+	  N_("Examine at most this many directory entries in a row when "
+	     "scanning new directories"),
+	  grecs_type_size, GRECS_DFLT, &scan_slice },
+	{ "journal-size", N_("n"),
+	  N_("Compact the journal when its size exceeds this many bytes"),
+	  grecs_type_size, GRECS_DFLT, &journal_max_size },
 	{"environ", NULL,
 	 N_("Modify global program environment."),
 	 grecs_type_section, GRECS_DFLT,
@@ -907,5 +1314,89 @@ config_parse(char const *conffile)
 		exit(1);
 	if (grecs_tree_process(tree, direvent_kw))
 		exit(1);
-	
+	watchconf_commit();
+}
+
+/*
+ * Settings naming the files that are kept open while the program runs.
+ * They cannot be changed by reloading the configuration.
+ */
+static struct restart_setting {
+	char const *name;
+	char **var;
+	char *save;
+} restart_settings[] = {
+	{ "trace-file", &trace_file },
+	{ "journal", &journal_file },
+	{ "snapshot", &snapshot_file },
+	{ NULL }
+};
+
+static int
+strnullcmp(char const *a, char const *b)
+{
+	if (!a || !b)
+		return a != b;
+	return strcmp(a, b);
+}
+
+/*
+ * Restore the settings that cannot be changed without restart.  If
+ * WARN is set, warn about the attempts to change them.
+ */
+static void
+restart_settings_restore(int warn)
+{
+	struct restart_setting *rs;
+
+	for (rs = restart_settings; rs->name; rs++) {
+		if (*rs->var == rs->save)
+			continue;
+		if (warn && strnullcmp(*rs->var, rs->save))
+			diag(LOG_WARNING,
+			     _("%s cannot be changed without restart; "
+			       "keeping %s"),
+			     rs->name, rs->save ? rs->save : _("none"));
+		free(*rs->var);
+		*rs->var = rs->save;
+	}
+}
+
+/*
+ * Re-read the configuration file.  On errors, the current configuration
+ * remains in effect.
+ */
+int
+config_reload(char const *conffile)
+{
+	struct grecs_node *tree;
+	envop_t *envop = direvent_envop;
+	struct restart_setting *rs;
+	int rc;
+
+	diag(LOG_INFO, _("reloading configuration from %s"), conffile);
+	direvent_envop = NULL;
+	for (rs = restart_settings; rs->name; rs++) {
+		rs->save = *rs->var;
+		*rs->var = NULL;
+	}
+	grecs_error_count = 0;
+	tree = grecs_parse(conffile);
+	rc = !tree
+		|| grecs_tree_process(tree, direvent_kw)
+		|| grecs_error_count;
+	restart_settings_restore(!rc);
+	rc = rc || watchconf_reload();
+	if (rc) {
+		diag(LOG_ERR,
+		     _("errors in configuration file; "
+		       "keeping current configuration"));
+		watchconf_discard();
+		envop_free(direvent_envop);
+		direvent_envop = envop;
+	} else
+		envop_free(envop);
+	if (tree)
+		grecs_tree_free(tree);
+	return rc;
 }
@@ -0,0 +1,265 @@
+/* direvent - directory content watcher daemon
+   Copyright (C) 2012-2021 Sergey Poznyakoff
+
+   GNU direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   GNU direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "direvent.h"
+#include <fcntl.h>
+
+/*
+ * Content digests.
+ *
+ * The digest of a file is its XXH64 hash.  The last digest computed for
+ * each file is kept in a bounded table, so that a change that leaves the
+ * content as it was can be recognized and, if requested, not reported.
+ */
+
+/* Max. number of digests kept */
+size_t digest_cache_size = DIGEST_CACHE_SIZE_DEFAULT;
+
+/* Digest of the file the event being delivered refers to, if any */
+char const *event_digest;
+
+static struct lrutab *digest_tab;
+
+/* Statistics */
+static unsigned long stat_digests;    /* Digests computed */
+static unsigned long stat_unchanged;  /* Changes that kept the content */
+
+/* XXH64 */
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+struct xxh64 {
+	uint64_t total_len;       /* Number of bytes hashed so far */
+	uint64_t v[4];            /* Accumulators */
+	unsigned char mem[32];    /* Pending input */
+	size_t memsize;           /* Number of bytes in mem */
+};
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+read64(unsigned char const *p)
+{
+	return (uint64_t) p[0]
+		| ((uint64_t) p[1] << 8)
+		| ((uint64_t) p[2] << 16)
+		| ((uint64_t) p[3] << 24)
+		| ((uint64_t) p[4] << 32)
+		| ((uint64_t) p[5] << 40)
+		| ((uint64_t) p[6] << 48)
+		| ((uint64_t) p[7] << 56);
+}
+
+static inline uint64_t
+read32(unsigned char const *p)
+{
+	return (uint64_t) p[0]
+		| ((uint64_t) p[1] << 8)
+		| ((uint64_t) p[2] << 16)
+		| ((uint64_t) p[3] << 24);
+}
+
+static inline uint64_t
+xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t
+xxh64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+static void
+xxh64_init(struct xxh64 *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->v[0] = PRIME64_1 + PRIME64_2;
+	st->v[1] = PRIME64_2;
+	st->v[2] = 0;
+	st->v[3] = -PRIME64_1;
+}
+
+static void
+xxh64_stripe(struct xxh64 *st, unsigned char const *p)
+{
+	st->v[0] = xxh64_round(st->v[0], read64(p));
+	st->v[1] = xxh64_round(st->v[1], read64(p + 8));
+	st->v[2] = xxh64_round(st->v[2], read64(p + 16));
+	st->v[3] = xxh64_round(st->v[3], read64(p + 24));
+}
+
+static void
+xxh64_update(struct xxh64 *st, unsigned char const *p, size_t len)
+{
+	st->total_len += len;
+	if (st->memsize + len < sizeof(st->mem)) {
+		memcpy(st->mem + st->memsize, p, len);
+		st->memsize += len;
+		return;
+	}
+	if (st->memsize) {
+		size_t n = sizeof(st->mem) - st->memsize;
+		memcpy(st->mem + st->memsize, p, n);
+		xxh64_stripe(st, st->mem);
+		p += n;
+		len -= n;
+		st->memsize = 0;
+	}
+	for (; len >= sizeof(st->mem); p += sizeof(st->mem),
+		     len -= sizeof(st->mem))
+		xxh64_stripe(st, p);
+	memcpy(st->mem, p, len);
+	st->memsize = len;
+}
+
+static uint64_t
+xxh64_final(struct xxh64 *st)
+{
+	unsigned char const *p = st->mem;
+	size_t len = st->memsize;
+	uint64_t h;
+
+	if (st->total_len >= sizeof(st->mem)) {
+		h = rotl64(st->v[0], 1) + rotl64(st->v[1], 7)
+			+ rotl64(st->v[2], 12) + rotl64(st->v[3], 18);
+		h = xxh64_merge(h, st->v[0]);
+		h = xxh64_merge(h, st->v[1]);
+		h = xxh64_merge(h, st->v[2]);
+		h = xxh64_merge(h, st->v[3]);
+	} else
+		h = st->v[2] /* the seed */ + PRIME64_5;
+	h += st->total_len;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		h ^= xxh64_round(0, read64(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (len >= 4) {
+		h ^= read32(p) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+		len -= 4;
+	}
+	for (; len > 0; p++, len--) {
+		h ^= *p * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * Compute the digest of the regular file NAME.  Return 0 on success.
+ *
+ * The file is read rather than mapped: a file truncated while its
+ * mapping is being hashed would raise SIGBUS.
+ */
+int
+file_digest(char const *name, uint64_t *ret)
+{
+	static unsigned char buf[65536];
+	struct xxh64 st;
+	struct stat sb;
+	ssize_t n;
+	int fd;
+
+	fd = open(name, O_RDONLY | O_NONBLOCK | O_NOCTTY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			diag(LOG_ERR, _("cannot open %s: %s"),
+			     name, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &sb) || !S_ISREG(sb.st_mode)) {
+		close(fd);
+		return -1;
+	}
+	xxh64_init(&st);
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		xxh64_update(&st, buf, n);
+	if (n == -1) {
+		diag(LOG_ERR, _("error reading %s: %s"),
+		     name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	*ret = xxh64_final(&st);
+	stat_digests++;
+	return 0;
+}
+
+/*
+ * Record DIGEST as the digest of the file NAME in the watchpoint WP.
+ * Return 1 if it is the same as the one recorded previously, and 0
+ * otherwise.
+ */
+int
+digest_update(struct watchpoint *wp, char const *name, uint64_t digest)
+{
+	uint64_t *dp;
+	int new;
+
+	if (!digest_tab)
+		digest_tab = lrutab_create("content digests", sizeof(*dp),
+					   digest_cache_size, 0);
+	else
+		/* Pick up the settings after a reload */
+		lrutab_set_limits(digest_tab, digest_cache_size, 0);
+	dp = lrutab_install(digest_tab, wp->serial, name, &new);
+	if (!new && *dp == digest) {
+		stat_unchanged++;
+		return 1;
+	}
+	*dp = digest;
+	return 0;
+}
+
+/* Forget the digest of the file NAME in the watchpoint WP */
+void
+digest_forget(struct watchpoint *wp, char const *name)
+{
+	if (digest_tab)
+		lrutab_remove(digest_tab, wp->serial, name);
+}
+
+void
+digest_stats(void)
+{
+	if (!digest_tab)
+		return;
+	diag(LOG_INFO, _("digests: %lu computed, %lu unchanged"),
+	     stat_digests, stat_unchanged);
+	lrutab_stats(digest_tab);
+}
@@ -17,6 +17,10 @@
 #include "direvent.h"
 #include <stdarg.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <getopt.h>
 #include <pwd.h>
 #include <grp.h>
@@ -71,48 +75,501 @@ severity(int prio)
 	return NULL;
 }
 
-void
-vdiag(int prio, const char *fmt, va_list ap)
+/*
+ * Format FMT and AP into the buffer *PBUF of size *PSIZE, growing it as
+ * necessary.  This does not use erealloc, since it may be called to
+ * report an allocation failure: if the buffer cannot be grown, the
+ * message is truncated.
+ */
+static void
+diag_vformat(char **pbuf, size_t *psize, const char *fmt, va_list ap)
 {
-	const char *s;
-	va_list tmp;
-	
-	if (log_to_stderr >= prio) {
-		fprintf(stderr, "%s: ", program_name);
-		s = severity(prio);
-		if (s)
-			fprintf(stderr, "[%s] ", s);
+	for (;;) {
+		va_list tmp;
+		int n;
+		char *p;
+
 		va_copy(tmp, ap);
-		vfprintf(stderr, fmt, tmp);
-		fputc('\n', stderr);
+		n = vsnprintf(*pbuf, *psize, fmt, tmp);
 		va_end(tmp);
+		if (n < 0) {
+			if (*psize)
+				**pbuf = 0;
+			return;
+		}
+		if ((size_t) n < *psize)
+			return;
+		p = realloc(*pbuf, n + 1);
+		if (!p)
+			return;
+		*pbuf = p;
+		*psize = n + 1;
+	}
+}
+
+static void
+diag_format(char **pbuf, size_t *psize, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	diag_vformat(pbuf, psize, fmt, ap);
+	va_end(ap);
+}
+
+#ifndef _PATH_LOG
+# define _PATH_LOG "/dev/log"
+#endif
+
+/*
+ * Non-blocking output.
+ *
+ * While logging is buffered, messages are written to a non-blocking
+ * socket connected to the syslog daemon, instead of using syslog(3),
+ * which blocks when the daemon does not keep up.  If the socket cannot
+ * be opened, syslog(3) is used as before.  Messages to stderr are
+ * written only if it is ready for writing.
+ */
+static int diag_log_fd = -1;    /* Syslog socket */
+static char *diag_out;          /* Output buffer */
+static size_t diag_out_size;
+
+static int
+diag_log_open(void)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd == -1)
+		return -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, _PATH_LOG, sizeof(sa.sun_path) - 1);
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1
+	    || fcntl(fd, F_SETFD, FD_CLOEXEC) == -1
+	    || connect(fd, (struct sockaddr *) &sa, sizeof(sa)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+diag_log_close(void)
+{
+	if (diag_log_fd != -1) {
+		close(diag_log_fd);
+		diag_log_fd = -1;
+	}
+}
+
+/*
+ * Send the message TEXT to the syslog socket.  Return 0 on success, 1
+ * if the message would block, and -1 on error.
+ */
+static int
+diag_log_send(int prio, const char *ident, const char *text)
+{
+	static const char *month[] = {
+		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+	};
+	const char *s = syslog_include_prio ? severity(prio) : NULL;
+	time_t now = time(NULL);
+	struct tm *tm = localtime(&now);
+
+	if (!ident)
+		ident = tag ? tag : program_name;
+	diag_format(&diag_out, &diag_out_size,
+		    "<%d>%s %2d %02d:%02d:%02d %s[%lu]: %s%s%s%s",
+		    facility | prio,
+		    month[tm->tm_mon], tm->tm_mday,
+		    tm->tm_hour, tm->tm_min, tm->tm_sec,
+		    ident, (unsigned long) getpid(),
+		    s ? "[" : "", s ? s : "", s ? "] " : "", text);
+	if (send(diag_log_fd, diag_out, strlen(diag_out), 0) == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK
+		    || errno == ENOBUFS)
+			return 1;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+diag_stderr_ready(void)
+{
+	struct pollfd pfd;
+
+	pfd.fd = 2;
+	pfd.events = POLLOUT;
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT);
+}
+
+/*
+ * Output the message TEXT, logging it under syslog tag IDENT, if given.
+ * If NONBLOCK is set, don't wait for the output to become ready.
+ * Return 0 on success and -1 if the message was not written.
+ */
+static int
+diag_write(int prio, const char *ident, const char *text, int nonblock)
+{
+	const char *s = severity(prio);
+	int rc = 0;
+
+	if (log_to_stderr >= prio) {
+		if (!nonblock) {
+			if (s)
+				fprintf(stderr, "%s: [%s] %s\n",
+					program_name, s, text);
+			else
+				fprintf(stderr, "%s: %s\n",
+					program_name, text);
+		} else if (diag_stderr_ready()) {
+			if (s)
+				diag_format(&diag_out, &diag_out_size,
+					    "%s: [%s] %s\n",
+					    program_name, s, text);
+			else
+				diag_format(&diag_out, &diag_out_size,
+					    "%s: %s\n", program_name, text);
+			if (write(2, diag_out, strlen(diag_out)) == -1)
+				rc = -1;
+		} else
+			rc = -1;
 	}
 
 	if (facility > 0) {
-		if (syslog_include_prio && (s = severity(prio)) != NULL) {
-			static char *fmtbuf;
-			static size_t fmtsize;
-			size_t len = strlen(fmt) + strlen(s) + 4;
-			char *p;
-			
-			if (len > fmtsize) {
-				fmtbuf = erealloc(fmtbuf, len);
-				fmtsize = len;
+		if (nonblock && diag_log_fd != -1) {
+			switch (diag_log_send(prio, ident, text)) {
+			case 0:
+				return rc;
+			case 1:
+				return -1;
+			default:
+				/* Reconnect on the next flush */
+				diag_log_close();
+			}
+		}
+		if (ident)
+			openlog(ident, LOG_PID, facility);
+		if (syslog_include_prio && s)
+			syslog(prio, "[%s] %s", s, text);
+		else
+			syslog(prio, "%s", text);
+		if (ident)
+			openlog(tag, LOG_PID, facility);
+	}
+	return rc;
+}
+
+/*
+ * Buffered logging.
+ *
+ * While the main loop runs, messages are formatted into a bounded ring
+ * which is written out by diag_flush once per loop iteration without
+ * blocking.  Messages that do not fit into the ring, as well as those
+ * that cannot be written at once, are dropped and counted, so that a
+ * stalled syslog daemon or stderr reader cannot hold up event
+ * processing.
+ *
+ * Consecutive identical messages are collapsed into a single "last
+ * message repeated" notice, and messages that share the same format
+ * are limited to DIAG_RATE_BURST per DIAG_RATE_INTERVAL seconds.
+ * Debugging messages are exempt from both.
+ */
+#define DIAG_RING_SIZE     256  /* Max. number of pending messages */
+#define DIAG_RATE_SLOTS    64   /* Size of the rate limiting table */
+#define DIAG_RATE_INTERVAL 5    /* Rate limiting interval, in seconds */
+#define DIAG_RATE_BURST    20   /* Max. messages per format and interval */
+
+struct diag_rec {
+	int prio;            /* Message priority */
+	int has_ident;       /* True if ident is set */
+	char *ident;         /* Syslog tag */
+	size_t ident_size;   /* Allocated size of ident */
+	char *text;          /* Formatted message */
+	size_t text_size;    /* Allocated size of text */
+};
+
+struct diag_rate {
+	const char *fmt;     /* Message format */
+	time_t start;        /* Start of the current interval */
+	unsigned count;      /* Number of messages in this interval */
+	unsigned long suppressed; /* Number of suppressed messages */
+};
+
+static int diag_buffered;
+static const char *diag_ident;
+static struct diag_rec diag_ring[DIAG_RING_SIZE];
+static size_t diag_head, diag_count;
+static struct diag_rate diag_rate_tab[DIAG_RATE_SLOTS];
+static unsigned long diag_rate_pending;
+
+/* The last message, for deduplication */
+static int diag_last_prio = -1;
+static char *diag_last_text;
+static size_t diag_last_size;
+static time_t diag_last_time;
+static unsigned long diag_repeat;
+
+/* Statistics */
+static unsigned long diag_dropped_total, diag_dropped;
+static unsigned long diag_suppressed_total;
+static unsigned long diag_repeat_total;
+
+static int
+diag_strset(char **pbuf, size_t *psize, const char *s)
+{
+	size_t len = strlen(s) + 1;
+
+	if (len > *psize) {
+		char *p = realloc(*pbuf, len);
+		if (!p)
+			return -1;
+		*pbuf = p;
+		*psize = len;
+	}
+	memcpy(*pbuf, s, len);
+	return 0;
+}
+
+/* Add a message to the ring, or output it if the ring is not in use. */
+static void
+diag_put(int prio, const char *ident, const char *text)
+{
+	struct diag_rec *rp;
+
+	if (!diag_buffered) {
+		diag_write(prio, ident, text, 0);
+		return;
+	}
+	if (diag_count == DIAG_RING_SIZE) {
+		diag_dropped++;
+		diag_dropped_total++;
+		return;
+	}
+	rp = &diag_ring[(diag_head + diag_count) % DIAG_RING_SIZE];
+	if (diag_strset(&rp->text, &rp->text_size, text)) {
+		diag_dropped++;
+		diag_dropped_total++;
+		return;
+	}
+	rp->prio = prio;
+	rp->has_ident = ident && diag_strset(&rp->ident, &rp->ident_size,
+					     ident) == 0;
+	diag_count++;
+}
+
+static void
+diag_repeat_flush(void)
+{
+	if (diag_repeat) {
+		char buf[80];
+		snprintf(buf, sizeof(buf),
+			 _("last message repeated %lu times"), diag_repeat);
+		diag_repeat = 0;
+		diag_put(diag_last_prio, NULL, buf);
+	}
+}
+
+static void
+diag_rate_report(struct diag_rate *rp)
+{
+	if (rp->suppressed) {
+		char buf[512];
+		snprintf(buf, sizeof(buf),
+			 _("suppressed %lu messages like \"%s\""),
+			 rp->suppressed, rp->fmt);
+		rp->suppressed = 0;
+		diag_rate_pending--;
+		diag_put(LOG_NOTICE, NULL, buf);
+	}
+}
+
+/* Return true if a message with the format FMT must be suppressed. */
+static int
+diag_ratelimit(const char *fmt, time_t now)
+{
+	struct diag_rate *rp =
+		&diag_rate_tab[((unsigned long) fmt >> 3) % DIAG_RATE_SLOTS];
+
+	if (rp->fmt != fmt || now - rp->start >= DIAG_RATE_INTERVAL) {
+		diag_rate_report(rp);
+		rp->fmt = fmt;
+		rp->start = now;
+		rp->count = 0;
+	}
+	if (++rp->count > DIAG_RATE_BURST) {
+		if (rp->suppressed++ == 0)
+			diag_rate_pending++;
+		diag_suppressed_total++;
+		return 1;
+	}
+	return 0;
+}
+
+/* Log the following messages under the syslog tag IDENT (NULL to
+   restore the default). */
+void
+diag_set_ident(const char *ident)
+{
+	diag_ident = ident;
+}
+
+void
+vdiag(int prio, const char *fmt, va_list ap)
+{
+	static char *buf;
+	static size_t size;
+	time_t now = 0;
+
+	if (!diag_buffered) {
+		diag_vformat(&buf, &size, fmt, ap);
+		diag_write(prio, diag_ident, buf, 0);
+		return;
+	}
+
+	if (prio < LOG_DEBUG) {
+		now = time(NULL);
+		/* Handler output is not rate limited */
+		if (!diag_ident && diag_ratelimit(fmt, now))
+			return;
+	}
+	diag_vformat(&buf, &size, fmt, ap);
+	if (prio < LOG_DEBUG) {
+		if (prio == diag_last_prio && !diag_ident
+		    && strcmp(buf, diag_last_text) == 0) {
+			diag_repeat++;
+			diag_repeat_total++;
+			diag_last_time = now;
+			return;
+		}
+		diag_repeat_flush();
+		if (!diag_ident
+		    && diag_strset(&diag_last_text, &diag_last_size, buf) == 0) {
+			diag_last_prio = prio;
+			diag_last_time = now;
+		} else
+			diag_last_prio = -1;
+	}
+	diag_put(prio, diag_ident, buf);
+}
+
+/*
+ * Write out pending messages.  If NONBLOCK is set, drop the messages
+ * that cannot be written at once.
+ */
+static void
+diag_drain(int nonblock)
+{
+	if (nonblock && facility > 0 && diag_log_fd == -1)
+		diag_log_fd = diag_log_open();
+
+	if (diag_repeat || diag_rate_pending) {
+		time_t now = time(NULL);
+
+		if (diag_repeat && now - diag_last_time >= DIAG_RATE_INTERVAL)
+			diag_repeat_flush();
+		if (diag_rate_pending) {
+			int i;
+			for (i = 0; i < DIAG_RATE_SLOTS; i++) {
+				struct diag_rate *rp = &diag_rate_tab[i];
+				if (rp->suppressed
+				    && now - rp->start >= DIAG_RATE_INTERVAL)
+					diag_rate_report(rp);
 			}
+		}
+	}
+
+	while (diag_count) {
+		struct diag_rec *rp = &diag_ring[diag_head];
+		if (diag_write(rp->prio, rp->has_ident ? rp->ident : NULL,
+			       rp->text, nonblock)) {
+			diag_dropped++;
+			diag_dropped_total++;
+		}
+		diag_head = (diag_head + 1) % DIAG_RING_SIZE;
+		diag_count--;
+	}
 
-			p = fmtbuf;
-			*p++ = '[';
-			while (*s)
-				*p++ = *s++;
-			*p++ = ']';
-			*p++ = ' ';
-			while (*p++ = *fmt++);
-			vsyslog(prio, fmtbuf, ap);
-		} else			
-			vsyslog(prio, fmt, ap);
+	if (diag_dropped) {
+		char buf[80];
+		snprintf(buf, sizeof(buf),
+			 _("%lu log messages dropped"), diag_dropped);
+		if (diag_write(LOG_WARNING, NULL, buf, nonblock) == 0)
+			diag_dropped = 0;
 	}
 }
 
+/* Write out pending messages without blocking. */
+void
+diag_flush(void)
+{
+	if (diag_buffered)
+		diag_drain(1);
+}
+
+static void
+diag_exit(void)
+{
+	diag_buffering(0);
+}
+
+/*
+ * Enable or disable buffered logging.  When disabling, all pending
+ * messages and notices are written out.
+ */
+void
+diag_buffering(int enable)
+{
+	static int registered;
+
+	if (enable) {
+		if (!registered) {
+			atexit(diag_exit);
+			registered = 1;
+		}
+		diag_buffered = 1;
+	} else if (diag_buffered) {
+		int i;
+
+		diag_repeat_flush();
+		for (i = 0; i < DIAG_RATE_SLOTS; i++)
+			diag_rate_report(&diag_rate_tab[i]);
+		diag_drain(0);
+		diag_log_close();
+		diag_buffered = 0;
+		diag_last_prio = -1;
+	}
+}
+
+/*
+ * Switch to unbuffered logging in a newly forked child process,
+ * discarding any state inherited from the parent.
+ */
+void
+diag_fork_child(void)
+{
+	diag_buffered = 0;
+	diag_log_close();
+	diag_count = 0;
+	diag_last_prio = -1;
+	diag_repeat = 0;
+	diag_dropped = 0;
+	diag_rate_pending = 0;
+	memset(diag_rate_tab, 0, sizeof(diag_rate_tab));
+}
+
+void
+diag_stats(void)
+{
+	diag(LOG_INFO,
+	     _("logging: %lu messages dropped, %lu suppressed, %lu repeated"),
+	     diag_dropped_total, diag_suppressed_total, diag_repeat_total);
+}
+
 void
 diag(int prio, const char *fmt, ...)
 {
@@ -203,6 +660,32 @@ mkfilename(const char *dir, const char *file)
 	}
 	return tmp;
 }
+
+/*
+ * Stat the entry NAME of the directory DIRNAME, which is open as DIR.
+ * Unless FOLLOW is set, symbolic links are not followed.  If possible,
+ * NAME is looked up relative to the open directory, which saves
+ * resolving the directory pathname again for each of its entries.
+ */
+int
+dirent_stat(DIR *dir, char const *dirname, char const *name,
+	    struct stat *st, int follow)
+{
+#ifdef HAVE_FSTATAT
+	return fstatat(dirfd(dir), name, st, follow ? 0 : AT_SYMLINK_NOFOLLOW);
+#else
+	char *pathname = mkfilename(dirname, name);
+	int rc;
+
+	if (!pathname) {
+		errno = ENOMEM;
+		return -1;
+	}
+	rc = follow ? stat(pathname, st) : lstat(pathname, st);
+	free(pathname);
+	return rc;
+#endif
+}
 
 int
 trans_fullmask(struct transtab *tab)
@@ -290,7 +773,7 @@ void
 signal_setup(void (*sf) (int))
 {
 	static int sigv[] = { SIGTERM, SIGQUIT, SIGINT, SIGHUP, SIGALRM,
-			      SIGUSR1, SIGUSR1, SIGCHLD };
+			      SIGUSR1, SIGUSR2, SIGCHLD };
 	sigv_set_all(sf, NITEMS(sigv), sigv, NULL);
 }
 
@@ -392,70 +875,82 @@ setuser(const char *user)
 }
 
 /*
- * Format flags as a space-delimited string according to the translation table
- * tab.  The string is allocated.  If psize points to a non-zero value, this
- * value is used as the length of the buffer to allocate for the result.  If
- * it points to a zero value, buffer size is computed using trans_stat and
- * stored in *psize upon return.
+ * Event name lists.
+ *
+ * The space-delimited list of event names for a given mask is built on
+ * first use and kept for the lifetime of the program, so that formatting
+ * an event costs no allocations.  Masks are mapped to a compact index
+ * having one bit per entry of the translation table, which keeps the
+ * cache small even for sparse system event masks.
+ */
+struct trans_names {
+	struct transtab *tab;   /* Translation table */
+	size_t count;           /* Number of entries in tab */
+	char **names;           /* Name lists, indexed by compact mask */
+};
+
+static struct trans_names genev_names = { genev_transtab };
+static struct trans_names sysev_names = { sysev_transtab };
+
+/*
+ * Format flags as a space-delimited string according to the translation
+ * table tab.  The string is allocated.
  */
 static char *
-flags_format(int flags, struct transtab *tab, size_t *psize)
+flags_format(int flags, struct transtab *tab)
 {
-	size_t size = *psize;
-	char *buf;
-	
-	if (!size) {
-		size_t count = trans_stat(tab, &size);
-		size += count;
-		*psize = size;
-	}
-	buf = malloc(size + 1);
-	if (buf) {
-		char *p, *q;
-		int i;
+	size_t size = 0;
+	struct transtab *tp;
+	char *buf, *p, *q;
+	int i;
 
-		q = buf;
-		for (p = trans_tokfirst(tab, flags, &i); p;
-		     p = trans_toknext(tab, flags, &i)) {
-			if (q > buf)
-				*q++ = ' ';
-			while (*p)
-				*q++ = *p++;
-		}
-		*q = 0;	
+	for (tp = tab; tp->name; tp++)
+		if (tp->tok & flags)
+			size += strlen(tp->name) + 1;
+	q = buf = emalloc(size + 1);
+	for (p = trans_tokfirst(tab, flags, &i); p;
+	     p = trans_toknext(tab, flags, &i)) {
+		if (q > buf)
+			*q++ = ' ';
+		while (*p)
+			*q++ = *p++;
 	}
+	*q = 0;
 	return buf;
 }
 
+static char const *
+trans_names_get(struct trans_names *tn, int flags)
+{
+	size_t i, idx = 0;
+
+	if (!tn->names) {
+		tn->count = trans_stat(tn->tab, NULL);
+		tn->names = ecalloc((size_t) 1 << tn->count,
+				    sizeof(tn->names[0]));
+	}
+	for (i = 0; i < tn->count; i++)
+		if (tn->tab[i].tok & flags)
+			idx |= (size_t) 1 << i;
+	if (!tn->names[idx])
+		tn->names[idx] = flags_format(flags, tn->tab);
+	return tn->names[idx];
+}
+
 /*
  * Format event_mask ev as two strings.
- * On success, stores the generic event names in *gen, and system event names
- * in *sys (both formatted as a space-delimited list of names).  If either
- * of them is NULL, the corresponding value is not computed.
- * Returns 0 on success and -1 on error (out of memory).
+ * Stores the generic event names in *gen, and system event names in *sys
+ * (both formatted as a space-delimited list of names).  If either of them
+ * is NULL, the corresponding value is not computed.  The returned strings
+ * must not be freed.
  */
-int
-ev_format(event_mask ev, char **gen, char **sys)
+void
+ev_format(event_mask ev, char const **gen, char const **sys)
 {
-	static size_t gen_size, sys_size;
-	int r = 0;
-	
-	if (gen) {
-		if ((*gen = flags_format(ev.gen_mask, genev_transtab,
-					 &gen_size)) == NULL)
-			r = -1;
-	}
-	
-	if (sys) {
-		if ((*sys = flags_format(ev.sys_mask, sysev_transtab,
-					 &sys_size)) == NULL) {
-			free(*gen);
-			*gen = NULL;
-			r = -1;
-		}
-	}
-
-	return r;
+	if (gen)
+		*gen = trans_names_get(&genev_names, ev.gen_mask);
+	if (sys)
+		*sys = trans_names_get(&sysev_names, ev.sys_mask);
 }
 
 /*
@@ -465,13 +960,9 @@ ev_format(event_mask ev, char **gen, char **sys)
 void
 ev_log(int prio, struct watchpoint *dp, event_mask ev, char *prefix)
 {
-	char *sys, *gen;
-
-	if (ev_format(ev, &gen, &sys)) {
-		diag(LOG_ERR, "%s", _("out of memory"));
-		return;
-	}
+	char const *sys, *gen;
 
+	ev_format(ev, &gen, &sys);
 	if (prefix) {
 		diag(prio, "%s: %s: system events: %s", dp->dirname, prefix,
 		     sys);
@@ -481,13 +972,12 @@ ev_log(int prio, struct watchpoint *dp, event_mask ev, char *prefix)
 		diag(prio, "%s: system events: %s", dp->dirname, sys);
 		diag(prio, "%s: generic events: %s", dp->dirname, gen);
 	}
-	free(sys);
-	free(gen);
 }
 
 
 int signo = 0;
 int stop = 0;
+int reload_requested = 0;
 
 pid_t self_test_pid;
 int exit_code = 0;
@@ -500,6 +990,12 @@ sigmain(int sig)
 	case SIGCHLD:
 	case SIGALRM:
 		break;
+	case SIGUSR2:
+		stats_requested = 1;
+		break;
+	case SIGHUP:
+		reload_requested = 1;
+		break;
 	default:
 		stop = 1;
 	}
@@ -550,6 +1046,20 @@ static int lint_only = 0;
 
 #include "cmdline.h"
 
+/* Re-read the configuration file upon SIGHUP */
+static void
+reload_config(void)
+{
+	int level = debug_level;
+
+	/* Debug level from the command line is added to the configured one */
+	debug_level = 0;
+	if (config_reload(conffile))
+		debug_level = level;
+	else
+		debug_level += opt_debug_level;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -586,6 +1096,15 @@ main(int argc, char **argv)
 	if (lint_only)
 		return 0;
 
+	/* Make sure the file can be re-read after chdir */
+	if (conffile[0] != '/') {
+		char *cwd = getcwd(NULL, 0);
+		if (cwd) {
+			conffile = mkfilename(cwd, conffile);
+			free(cwd);
+		}
+	}
+
 	if (opt_debug_level)
 		debug_level += opt_debug_level;
 	if (opt_foreground)
@@ -621,25 +1140,51 @@ main(int argc, char **argv)
 	if (pidfile)
 		storepid(pidfile);
 
+	journal_open();
+
 	/* Relinquish superuser privileges */
 	if (user && getuid() == 0)
 		setuser(user);
 
 	signal_setup(sigmain);
 
+	stats_init();
+	trace_open();
+
 	if (self_test_prog)
 		self_test();
+
+	journal_replay();
+	snapshot_replay();
+
+	diag_buffering(1);
 	
 	/* Main loop */
 	while (!stop && sysev_select() == 0) {
+		journal_flush();
 		process_timeouts();
+		scan_run(scan_slice);
 		process_cleanup(0);
 		watchpoint_gc();
+		if (reload_requested) {
+			reload_requested = 0;
+			reload_config();
+		}
+		if (stats_requested) {
+			stats_requested = 0;
+			stats_dump();
+		}
+		diag_flush();
 	}
 
+	capture_close_all();
+	snapshot_save();
 	shutdown_watchers();
+	journal_close();
+	trace_close();
 
 	diag(LOG_INFO, _("%s %s stopped"), program_name, VERSION);
+	diag_buffering(0);
 
 	if (pidfile)
 		unlink(pidfile);
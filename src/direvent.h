@@ -16,6 +16,8 @@
 
 #include "config.h"
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <syslog.h>
@@ -23,7 +25,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
 #include <regex.h>
+#include <dirent.h>
 #include <grecs/list.h>
 #include <grecs/symtab.h>
 #include <envop.h>
@@ -38,6 +42,7 @@
 #define GENEV_ATTRIB   0x04
 #define GENEV_DELETE   0x08
 #define GENEV_CHANGE   0x10
+#define GENEV_MOVE     0x20
 
 /* Handler flags. */
 #define HF_NOWAIT  0x01   /* Don't wait for termination */
@@ -48,6 +53,9 @@
 #ifndef DEFAULT_TIMEOUT
 # define DEFAULT_TIMEOUT 5
 #endif
+#ifndef DEFAULT_OUTPUT_GRACE
+# define DEFAULT_OUTPUT_GRACE 2
+#endif
 
 typedef struct {
 	int gen_mask;        /* Generic event mask */
@@ -87,27 +95,81 @@ typedef int (*event_handler_fn) (struct watchpoint *wp,
 				 int notify);
 typedef void (*handler_free_fn) (void *data);
 
+/* File types for attribute filters */
+#define FT_REG   0x01
+#define FT_DIR   0x02
+#define FT_LNK   0x04
+#define FT_FIFO  0x08
+#define FT_SOCK  0x10
+#define FT_CHR   0x20
+#define FT_BLK   0x40
+
+/* Max. length of a content signature */
+#define CONTENT_PREFIX_MAX 64
+
+/* Content signature: the bytes a file must begin with */
+struct signature {
+	size_t len;
+	unsigned char bytes[CONTENT_PREFIX_MAX];
+};
+
+/* Attribute filter: conditions the file must satisfy for the handler
+   to be run */
+struct attrfilter {
+	int types;            /* File types (FT_* bitmask), 0 for any */
+	size_t min_size;      /* Size range */
+	size_t max_size;
+	uid_t *uidv;          /* Owners */
+	size_t uidc;          /* Number of elements in uidv, 0 for any */
+	gid_t *gidv;          /* Groups */
+	size_t gidc;          /* Number of elements in gidv, 0 for any */
+	unsigned long mode;   /* Mode bits that must be set */
+	unsigned min_age;     /* Range of the time since the last */
+	unsigned max_age;     /* modification, in seconds */
+	struct signature *sigv; /* Content signatures */
+	size_t sigc;          /* Number of elements in sigv, 0 for any */
+};
+
+/* Attributes of the file an event is delivered for, looked up on
+   demand (see handler_attr_match) */
+struct evstat {
+	char const *dirname;
+	char const *filename;
+	int state;            /* 0: not looked up, 1: valid, -1: failed */
+	struct stat st;
+	int head_state;       /* Same as state, for the head of the file */
+	size_t headlen;       /* Number of bytes in head */
+	unsigned char head[CONTENT_PREFIX_MAX]; /* First bytes of the file */
+	int digest_state;     /* Same as state, for the content digest */
+	int digest_same;      /* Content is the same as before */
+	char digest[17];      /* Content digest in hex */
+};
+
+#define EVSTAT_INIT(d, f) { (d), (f), 0 }
+
 /* Handler structure */
 struct handler {
 	size_t refcnt;        /* Reference counter */
 	event_mask ev_mask;   /* Event mask */
 	filpatlist_t fnames;  /* File name patterns */
+	filpatlist_t tnames;  /* Temporary file name patterns */
+	filpatlist_t xnames;  /* Excluded subdirectory patterns */
 	event_handler_fn run;
 	handler_free_fn free;
 	void *data;
 	int notify_always;
+	int poll;             /* Watch by polling (backend poll) */
+	struct attrfilter *filter; /* Attribute filter, if any */
+	int digest;           /* Content digest flags (HD_*) */
 };
 
+/* Content digest flags */
+#define HD_DIGEST  0x01   /* Compute content digest on change */
+#define HD_CHANGED 0x02   /* Run only if the content has changed */
+
 typedef struct handler_list *handler_list_t;
 typedef struct handler_iterator *handler_iterator_t;
 
-struct recent_head {
-	struct watchpoint *prev;
-	struct watchpoint *next;
-	struct grecs_symtab *names;
-	struct timeval tv;
-};
-
 /* Watchpoint links the directory being monitored and a list of
    handlers for various events: */
 struct watchpoint {
@@ -117,37 +179,73 @@ struct watchpoint {
 					        NULL for top-level watchers */
 	char *dirname;                       /* Pathname being watched */
 	int isdir;                           /* Is it directory */
-	handler_list_t handler_list;         /* List of handlers */
+	int isspine;                         /* Watched only to expand a glob
+						pattern */
+	handler_list_t handler_list;         /* List of handlers (shared) */
+	handler_list_t sentinel_list;        /* List of sentinels (private) */
 	int depth;                           /* Recursion depth */
 	char *split_p;                       /* Points to the deleted directory
 						separator in dirname (see
 						split_pathname,
 						unsplit_pathname */
-	struct recent_head rhead;
+	unsigned long serial;                /* Serial number */
+	unsigned long recent_gen;            /* Generation in which the
+						directory was created (see
+						watchpoint_recent_init) */
+	unsigned long activity;              /* Number of recent events (see
+						poll_rebalance) */
+	struct polldir *poll;                /* Polling state, if polled */
 #if USE_IFACE == IFACE_KQUEUE
 	int file_changed;
 	time_t file_ctime;
-#else
-	struct grecs_symtab *files_changed;	
 #endif
 };
 
 struct handler *handler_alloc(event_mask ev_mask);
 void handler_free(struct handler *hp);
+
+/* Latency histogram */
+#define LATENCY_BUCKETS 25  /* Bucket I counts samples below 2^I us */
+
+struct latency_hist {
+	unsigned long count;        /* Number of samples */
+	unsigned long long total;   /* Sum of all samples (us) */
+	unsigned long long max;     /* Maximum sample (us) */
+	unsigned long bucket[LATENCY_BUCKETS];
+};
+
+void latency_hist_add(struct latency_hist *hist, unsigned long long usec);
+void latency_hist_log(struct latency_hist *hist, char const *name,
+		      char const *stage);
 
 struct prog_handler {
+	size_t refcnt; /* Reference counter */
+	struct prog_handler *prev, *next; /* Links to other handlers */
 	int flags;     /* Handler flags */
 	char *command; /* Handler command (with eventual arguments) */
+	char *name;    /* Location of the watcher, for statistics */
 	uid_t uid;     /* Run as this user (unless 0) */
 	gid_t *gidv;   /* Run with these groups' privileges */
 	size_t gidc;   /* Number of elements in gidv */
 	unsigned timeout; /* Handler timeout */
 	envop_t *envop;   /* Environment setup program */
+	struct latency_hist lat_dispatch; /* Event read to fork */
+	struct latency_hist lat_run;      /* Fork to exit */
+	filpatlist_t onames;  /* Names of the files the handler writes */
+	unsigned output_grace; /* Keep ignoring them for this many seconds
+				  after the handler exits */
+	size_t running;       /* Number of running processes */
+	time_t quiet_until;   /* End of the grace period */
+	unsigned long suppressed; /* Number of events suppressed */
 };
 
 struct handler *prog_handler_alloc(event_mask ev_mask, filpatlist_t fpat,
 				   struct prog_handler *p);
 void prog_handler_free(struct prog_handler *);
+void prog_handler_stats(void);
+int prog_handler_replay(char const *command, event_mask *event,
+			char const *dirname, char const *file,
+			unsigned long jid, char *jrec);
 
 
 extern int foreground;
@@ -161,6 +259,13 @@ extern unsigned opt_timeout;
 extern unsigned opt_flags;
 extern int signo;
 extern int stop;
+extern int stats_requested;
+extern int reload_requested;
+extern char *trace_file;
+extern char *journal_file;
+extern size_t journal_max_size;
+extern struct timespec event_read_time;
+extern unsigned long stat_events;
 
 extern pid_t self_test_pid;
 extern int exit_code;
@@ -174,9 +279,16 @@ void *erealloc(void *ptr, size_t size);
 char *estrdup(const char *str);
 
 char *mkfilename(const char *dir, const char *file);
+int dirent_stat(DIR *dir, char const *dirname, char const *name,
+		struct stat *st, int follow);
 
 void diag(int prio, const char *fmt, ...);
 void debugprt(const char *fmt, ...);
+void diag_set_ident(const char *ident);
+void diag_flush(void);
+void diag_buffering(int enable);
+void diag_fork_child(void);
+void diag_stats(void);
 
 #define debug(l, c) do { if (debug_level>=(l)) debugprt c; } while(0)
 
@@ -186,8 +298,11 @@ int detach(void (*)(void));
 int sysev_filemask(struct watchpoint *dp);
 void sysev_init(void);
 int sysev_add_watch(struct watchpoint *dwp, event_mask mask);
+int sysev_mod_watch(struct watchpoint *dwp, event_mask mask);
 void sysev_rm_watch(struct watchpoint *dwp);
 int sysev_select(void);
+void sysev_stats(void);
+size_t sysev_watch_limit(void);
 int sysev_name_to_code(const char *name);
 const char *sysev_code_to_name(int code);
 
@@ -220,6 +335,7 @@ struct pathent {
 void config_help(void);
 void config_init(void);
 void config_parse(const char *file);
+int config_reload(const char *file);
 
 int get_facility(const char *arg);
 int get_priority(const char *arg);
@@ -231,12 +347,38 @@ void watchpoint_gc(void);
 
 int watchpoint_pattern_match(struct watchpoint *dwp, const char *file_name);
 
+int handler_file_match(struct handler *hp, const char *name);
+int handler_excludes(struct handler *hp, const char *name,
+		     const char *relpath);
+void attrfilter_init(struct attrfilter *af);
+int attrfilter_is_empty(struct attrfilter const *af);
+void attrfilter_free(struct attrfilter *af);
+int handler_attr_match(struct handler *hp, struct evstat *es);
+void handler_dispatch(struct watchpoint *wp, struct handler *hp,
+		      event_mask *m, const char *dirname,
+		      const char *filename, struct evstat *es);
 void watchpoint_run_handlers(struct watchpoint *wp, event_mask event,
 			      const char *dirname, const char *filename);
+void watchpoint_run_move_handlers(struct watchpoint *wp, event_mask event,
+				  const char *dirname, const char *filename,
+				  struct watchpoint *peer,
+				  const char *peername, int to,
+				  const char *oldfile);
+int watchpoint_move(struct watchpoint *src, char const *oldname,
+		    struct watchpoint *dst, char const *newname);
+extern char const *event_oldfile;
 
 
 void setup_watchers(void);
 void shutdown_watchers(void);
+void watchpoint_foreach(int (*fn)(struct watchpoint *, void *), void *data);
+
+int watchconf_add(char const *path, long depth, struct handler *hp);
+int is_glob_pattern(char const *s);
+void watchconf_discard(void);
+void watchconf_commit(void);
+int watchconf_reload(void);
+int watchpoint_filemask(struct watchpoint *wpt);
 
 struct watchpoint *watchpoint_lookup(const char *dirname);
 struct watchpoint *watchpoint_install(const char *path, int *pnew);
@@ -252,7 +394,7 @@ int watch_pathname(struct watchpoint *parent, const char *dirname, int isdir,
 char *split_pathname(struct watchpoint *dp, char **dirname);
 void unsplit_pathname(struct watchpoint *dp);
 
-int ev_format(event_mask ev, char **gen, char **sys);
+void ev_format(event_mask ev, char const **gen, char const **sys);
 void ev_log(int prio, struct watchpoint *dp, event_mask ev, char *prefix);
 void deliver_ev_create(struct watchpoint *dp,
 		       const char *dirname, const char *filename,
@@ -260,13 +402,73 @@ void deliver_ev_create(struct watchpoint *dp,
 int subwatcher_create(struct watchpoint *parent, const char *dirname,
 		      int notify);
 
+struct lrutab;
+struct lrutab *lrutab_create(char const *id, size_t datasize, size_t max,
+			     time_t ttl);
+void lrutab_set_limits(struct lrutab *lt, size_t max, time_t ttl);
+void *lrutab_lookup(struct lrutab *lt, unsigned long serial,
+		    char const *name);
+void *lrutab_install(struct lrutab *lt, unsigned long serial,
+		     char const *name, int *pnew);
+int lrutab_remove(struct lrutab *lt, unsigned long serial, char const *name);
+void lrutab_expire(struct lrutab *lt, time_t now);
+void lrutab_stats(struct lrutab *lt);
+
+extern size_t change_max;
+extern unsigned change_ttl;
+#define CHANGE_MAX_DEFAULT 65536
+
+extern size_t digest_cache_size;
+#define DIGEST_CACHE_SIZE_DEFAULT 16384
+extern char const *event_digest;
+
+int file_digest(char const *name, uint64_t *ret);
+int digest_update(struct watchpoint *wp, char const *name, uint64_t digest);
+void digest_forget(struct watchpoint *wp, char const *name);
+void digest_stats(void);
+
 void watchpoint_recent_init(struct watchpoint *wp);
 void watchpoint_recent_deinit(struct watchpoint *wp);
 int watchpoint_recent_lookup(struct watchpoint *wp, char const *name);
 int watchpoint_recent_cleanup(void);
+void watchpoint_recent_stats(void);
+extern unsigned recent_ttl;
 
 #define WATCHPOINT_RECENT_TTL 1
 
+/* True if WPT is watched, either by a kernel watch or by polling */
+#define watchpoint_watched(wpt) ((wpt)->wd != -1 || (wpt)->poll != NULL)
+
+extern size_t kernel_watches;
+void watchpoint_event_mask(struct watchpoint *wpt, event_mask *mask);
+int watchpoint_poll_only(struct watchpoint *wpt);
+int watchpoint_promote(struct watchpoint *wpt);
+int watchpoint_demote(struct watchpoint *wpt);
+
+extern size_t watch_budget;
+extern unsigned poll_interval;
+extern unsigned poll_max_interval;
+extern size_t poll_budget;
+#define POLL_INTERVAL_DEFAULT 5
+#define POLL_MAX_INTERVAL_DEFAULT 60
+#define POLL_REBALANCE_INTERVAL 60
+
+int poll_add(struct watchpoint *wpt);
+int poll_fallback(struct watchpoint *wpt);
+void poll_remove(struct watchpoint *wpt);
+void poll_flush(struct watchpoint *wpt);
+int poll_timeouts(void);
+void poll_stats(void);
+size_t watch_limit(void);
+int watch_budget_exhausted(void);
+
+extern size_t scan_slice;
+#define SCAN_SLICE_DEFAULT 1000
+
+size_t scan_run(size_t limit);
+size_t scan_pending(void);
+void scan_stats(void);
+
 
 struct handler *handler_itr_first(struct watchpoint *dp,
 				       handler_iterator_t *itr);
@@ -283,14 +485,50 @@ handler_list_t handler_list_create(void);
 handler_list_t handler_list_copy(handler_list_t);
 void handler_list_unref(handler_list_t hlist);
 void handler_list_append(handler_list_t hlist, struct handler *hp);
-void handler_list_append_cow(handler_list_t *phlist, struct handler *hp);
 size_t handler_list_remove(handler_list_t hlist, struct handler *hp);
-size_t handler_list_remove_cow(handler_list_t *phlist, struct handler *hp);
 size_t handler_list_size(handler_list_t hlist);
 
+void stats_init(void);
+void stats_event_read(void);
+void stats_event_done(void);
+void stats_dump(void);
+unsigned long long timespec_diff_usec(struct timespec const *a,
+				      struct timespec const *b);
+void trace_open(void);
+void trace_close(void);
+void trace_handler(char const *command, pid_t pid,
+		   struct timespec const *ts_event,
+		   struct timespec const *ts_fork,
+		   struct timespec const *ts_exit);
+
+void journal_open(void);
+void journal_replay(void);
+void journal_flush(void);
+void journal_close(void);
+unsigned long journal_start(event_mask const *event, char const *dir,
+			    char const *file, char const *cmd,
+			    char **ret_payload);
+void journal_done(unsigned long id);
+void journal_fail(unsigned long id, char *payload);
+extern char *snapshot_file;
+void snapshot_load(void);
+void snapshot_free(void);
+int snapshot_loaded(void);
+void snapshot_scan_dir(struct watchpoint *wp);
+void snapshot_check(struct watchpoint *wp, char const *pathname,
+		    char const *name, struct stat const *st);
+void snapshot_scan_done(void);
+void snapshot_replay(void);
+void snapshot_save(void);
+
+void process_journal_foreach(void (*fn)(unsigned long, char const *, void *),
+			     void *data);
+
 struct process *process_lookup(pid_t pid);
 void process_cleanup(int expect_term);
 void process_timeouts(void);
+int capture_poll(int fd, int timeout);
+void capture_close_all(void);
 
 #define NITEMS(a) ((sizeof(a)/sizeof((a)[0])))
 struct sigtab {
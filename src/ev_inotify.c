@@ -41,77 +41,189 @@ event_mask genev_xlat[] = {
 	{ GENEV_WRITE,  IN_MODIFY },
 	{ GENEV_ATTRIB, IN_ATTRIB },
 	{ GENEV_DELETE, IN_DELETE|IN_MOVED_FROM },
+	{ GENEV_MOVE,   IN_MOVED_FROM|IN_MOVED_TO },
 	{ 0 }
 };
 
 
 static int ifd;
 
-static struct watchpoint **wptab;
-static size_t wpsize;
+/*
+ * Files that were changed, but not yet closed.  The table is bounded
+ * by the change-table-size and change-ttl settings, so that files which
+ * are never closed (e.g. written via mmap) cannot make it grow without
+ * limit.
+ */
+static struct lrutab *change_tab;
+
+/*
+ * Map of watch descriptors to watchpoints.
+ *
+ * The kernel hands out watch descriptors monotonically, so an array
+ * indexed by wd would keep growing under directory churn, even if the
+ * number of live watches stays the same.  Instead, an open-addressing
+ * hash table with linear probing is used.  Its size is a power of two
+ * and is kept between 2 and 8 times the number of live watches.
+ * Deletion shifts the subsequent entries of the probe sequence back, so
+ * no tombstones accumulate.
+ */
+struct wpslot {
+	int wd;
+	struct watchpoint *wpt;   /* NULL if the slot is free */
+};
+
+static struct wpslot *wptab;
+static size_t wpsize;     /* Number of slots */
+static size_t wpcount;    /* Number of used slots */
+
+#define WPTAB_MIN_SIZE 64
+
+static inline size_t
+wphash(int wd)
+{
+	return ((unsigned) wd * 2654435769U) & (wpsize - 1);
+}
+
+/* Return the slot for WD: either the one holding it or a free one. */
+static struct wpslot *
+wpslot(int wd)
+{
+	size_t i;
+
+	for (i = wphash(wd); wptab[i].wpt; i = (i + 1) & (wpsize - 1))
+		if (wptab[i].wd == wd)
+			break;
+	return &wptab[i];
+}
+
+static int
+wpresize(size_t newsize)
+{
+	struct wpslot *oldtab = wptab;
+	size_t oldsize = wpsize;
+	size_t i;
+
+	wptab = calloc(newsize, sizeof(wptab[0]));
+	if (!wptab) {
+		wptab = oldtab;
+		return -1;
+	}
+	wpsize = newsize;
+	for (i = 0; i < oldsize; i++)
+		if (oldtab[i].wpt)
+			*wpslot(oldtab[i].wd) = oldtab[i];
+	free(oldtab);
+	return 0;
+}
 
 static int
 wpreg(int wd, struct watchpoint *wpt)
 {
+	struct wpslot *slot;
+
 	if (wd < 0)
 		abort();
-	if (wd >= wpsize) {
-		size_t n = wpsize;
-		struct watchpoint **p;
-
-		if (n == 0)
-			n = sysconf(_SC_OPEN_MAX);
-		while (wd >= n) {
-			n *= 2;
-			if (n < wpsize) {
-				diag(LOG_CRIT,
-				     _("can't allocate memory for fd %d"),
-				     wd);
-				return -1;
-			}
-		}
-		p = realloc(wptab, n * sizeof(wptab[0]));
-		if (!p) {
-			diag(LOG_CRIT,
-			     _("can't allocate memory for fd %d"),
-			     wd);
-			return -1;
-		}
-
-		memset(p + wpsize, 0, (n - wpsize) * sizeof(wptab[0]));
-		wptab = p;
-		wpsize = n;
+	if ((wpcount + 1) * 2 > wpsize
+	    && wpresize(wpsize ? wpsize * 2 : WPTAB_MIN_SIZE)) {
+		diag(LOG_CRIT, _("can't allocate memory for fd %d"), wd);
+		return -1;
 	}
 	watchpoint_ref(wpt);
-	wptab[wd] = wpt;
+	slot = wpslot(wd);
+	if (slot->wpt)
+		watchpoint_unref(slot->wpt);
+	else
+		wpcount++;
+	slot->wd = wd;
+	slot->wpt = wpt;
 	return 0;
 }
 
 static void
 wpunreg(int wd)
 {
-	if (wd < 0 || wd > wpsize)
+	size_t i, j, k;
+
+	if (wd < 0)
 		abort();
-	if (wptab[wd]) {
-		watchpoint_unref(wptab[wd]);
-		wptab[wd] = NULL;
+	if (wpsize == 0)
+		return;
+	i = wpslot(wd) - wptab;
+	if (!wptab[i].wpt)
+		return;
+	watchpoint_unref(wptab[i].wpt);
+	wptab[i].wpt = NULL;
+	wpcount--;
+
+	/* Shift back the entries that follow in the probe sequence */
+	for (j = (i + 1) & (wpsize - 1); wptab[j].wpt;
+	     j = (j + 1) & (wpsize - 1)) {
+		k = wphash(wptab[j].wd);
+		/* Move the entry if its home slot K is not within (I, J] */
+		if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+			wptab[i] = wptab[j];
+			wptab[j].wpt = NULL;
+			i = j;
+		}
 	}
+
+	if (wpsize > WPTAB_MIN_SIZE && wpcount * 8 < wpsize)
+		wpresize(wpsize / 2);
 }
 
 static struct watchpoint *
 wpget(int wd)
 {
-	if (wd >= 0 && wd < wpsize)
-		return wptab[wd];
-	return NULL;
+	if (wpsize == 0)
+		return NULL;
+	return wpslot(wd)->wpt;
 }
-
+
+/* Log statistics of the backend */
+void
+sysev_stats(void)
+{
+	diag(LOG_INFO,
+	     _("inotify: %lu watches, table size %lu slots (%lu bytes)"),
+	     (unsigned long) wpcount, (unsigned long) wpsize,
+	     (unsigned long) (wpsize * sizeof(wptab[0])));
+	if (change_tab)
+		lrutab_stats(change_tab);
+}
+
 int
 sysev_filemask(struct watchpoint *dp)
 {
 	return 0;
 }
 
+/* Maximum number of watches per user, or 0 if not known */
+static size_t max_user_watches;
+
+#define MAX_USER_WATCHES_FILE "/proc/sys/fs/inotify/max_user_watches"
+
+static void
+read_watch_limit(void)
+{
+	FILE *fp;
+	unsigned long n;
+
+	fp = fopen(MAX_USER_WATCHES_FILE, "r");
+	if (!fp)
+		return;
+	if (fscanf(fp, "%lu", &n) == 1) {
+		max_user_watches = n;
+		debug(1, (_("inotify watch limit: %lu"), n));
+	}
+	fclose(fp);
+}
+
+size_t
+sysev_watch_limit(void)
+{
+	return max_user_watches;
+}
+
 void
 sysev_init()
 {
@@ -120,18 +232,26 @@ sysev_init()
 		diag(LOG_CRIT, "inotify_init: %s", strerror(errno));
 		exit(1);
 	}
+	read_watch_limit();
+}
+
+static int
+inotify_sysmask(event_mask *mask)
+{
+	int sysmask = evtrans_gen_to_sys(mask, genev_xlat);
+
+	if (mask->gen_mask & GENEV_CHANGE) {
+		sysmask |= CHANGED_MASK | IN_CLOSE_WRITE;
+	}
+	return sysmask;
 }
 
 int
 sysev_add_watch(struct watchpoint *wpt, event_mask mask)
 {
-	int sysmask = evtrans_gen_to_sys(&mask, genev_xlat);
 	int wd;
 
-	if (mask.gen_mask & GENEV_CHANGE) {
-		sysmask |= CHANGED_MASK | IN_CLOSE_WRITE;
-	}
-	wd = inotify_add_watch(ifd, wpt->dirname, sysmask);
+	wd = inotify_add_watch(ifd, wpt->dirname, inotify_sysmask(&mask));
 	if (wd >= 0 && wpreg(wd, wpt)) {
 		inotify_rm_watch(ifd, wd);
 		return -1;
@@ -139,6 +259,24 @@ sysev_add_watch(struct watchpoint *wpt, event_mask mask)
 	return wd;
 }
 
+/* Change event mask of an existing watchpoint */
+int
+sysev_mod_watch(struct watchpoint *wpt, event_mask mask)
+{
+	int wd;
+
+	wd = inotify_add_watch(ifd, wpt->dirname, inotify_sysmask(&mask));
+	if (wd == -1)
+		return -1;
+	if (wd != wpt->wd) {
+		/* The pathname now refers to another file */
+		inotify_rm_watch(ifd, wd);
+		errno = ENOENT;
+		return -1;
+	}
+	return 0;
+}
+
 void
 sysev_rm_watch(struct watchpoint *wpt)
 {
@@ -173,30 +311,37 @@ remove_watcher(const char *dir, const char *name)
 static int
 file_changed(struct watchpoint *wpt, char const *filename, int install)
 {
-	struct grecs_syment key;
-
 	if (install) {
-		if (!wpt->files_changed) {
-			wpt->files_changed = grecs_symtab_create_default(sizeof(struct grecs_syment));
-			if (!wpt->files_changed)
-				nomem_abend();
-		}
-	} else if (!wpt->files_changed)
-		return 0;
-
-	key.name = (char*) filename;
-	if (grecs_symtab_lookup_or_install(wpt->files_changed, &key,
-					   &install)) {
-		grecs_symtab_remove(wpt->files_changed, &key);
+		if (!change_tab)
+			change_tab = lrutab_create("changed files", 0,
+						   change_max, change_ttl);
+		else
+			/* Pick up the settings after a reload */
+			lrutab_set_limits(change_tab, change_max, change_ttl);
+		lrutab_install(change_tab, wpt->serial, filename, NULL);
 		return 1;
 	}
-	if (install)
-		nomem_abend();
-	return 0;
+	if (!change_tab)
+		return 0;
+	return lrutab_remove(change_tab, wpt->serial, filename);
 }
 
+/* A rename reported as a pair of IN_MOVED_FROM and IN_MOVED_TO events */
+struct move_pair {
+	struct watchpoint *src;   /* Source directory */
+	struct watchpoint *dst;   /* Destination directory */
+	char const *oldname;      /* Source file name */
+	char const *newname;      /* Destination file name */
+	char *oldfile;            /* Full pathname of the source */
+	int inplace;              /* Watchpoints were renamed in place */
+};
+
+/*
+ * Process a single event.  If MV is not NULL, the event is one half of
+ * the rename described by it.
+ */
 static void
-process_event(struct inotify_event *ep)
+dispatch_event(struct inotify_event *ep, struct move_pair *mv)
 {
 	struct watchpoint *wpt;
 	char *dirname, *filename;
@@ -247,18 +392,12 @@ process_event(struct inotify_event *ep)
 
 	if (ep->len == 0) {
 		if (wpt->isdir) {
-			char *sys_str = NULL;
+			char const *sys_str;
 			event.sys_mask = ep->mask;
-			if (ev_format(event, NULL, &sys_str))
-				diag(LOG_NOTICE,
-				     _("%s: ignoring event (%x) for the watchpoint directory"),
-				     wpt->dirname, ep->mask);
-			else {
-				diag(LOG_NOTICE,
-				     _("%s: ignoring event (%s) for the watchpoint directory"),
-				     wpt->dirname, sys_str);
-				free(sys_str);
-			}
+			ev_format(event, NULL, &sys_str);
+			diag(LOG_NOTICE,
+			     _("%s: ignoring event (%s) for the watchpoint directory"),
+			     wpt->dirname, sys_str);
 			return;
 		}
 		filename = split_pathname(wpt, &dirname);
@@ -267,8 +406,10 @@ process_event(struct inotify_event *ep)
 		filename = ep->name;
 	}
 
-	/* Translate system events to generic ones. */
+	/* Translate system events to generic ones.  The move event is
+	   raised only for paired renames (see process_move). */
 	evtrans_sys_to_gen(ep->mask, genev_xlat, &event);
+	event.gen_mask &= ~GENEV_MOVE;
 	if (ep->mask & CHANGED_MASK) {
 		file_changed(wpt, filename, 1);
 	}
@@ -277,19 +418,131 @@ process_event(struct inotify_event *ep)
 			/* Reset the flag and raise the event. */
 			event.gen_mask |= GENEV_CHANGE;
 		}
-	}
+	} else if (ep->mask & (IN_DELETE|IN_MOVED_FROM))
+		/* The name is gone: no close will be reported for it */
+		file_changed(wpt, filename, 0);
 	if (debug_level > 0)
 		ev_log(LOG_DEBUG, wpt, event, ep->name);
 
-	watchpoint_run_handlers(wpt, event, dirname, filename);
+	if (mv) {
+		int to = (ep->mask & IN_MOVED_TO) != 0;
+		watchpoint_run_move_handlers(wpt, event, dirname, filename,
+					     to ? mv->src : mv->dst,
+					     to ? mv->oldname : mv->newname,
+					     to, mv->oldfile);
+	} else
+		watchpoint_run_handlers(wpt, event, dirname, filename);
 	
 	unsplit_pathname(wpt);
 
 	if (ep->mask & (IN_DELETE|IN_MOVED_FROM)) {
 		debug(1, (_("%s/%s deleted"), wpt->dirname, ep->name));
-		remove_watcher(wpt->dirname, ep->name);
+		if (!(mv && mv->inplace))
+			remove_watcher(wpt->dirname, ep->name);
 	}
-}	
+}
+
+/*
+ * Renames.
+ *
+ * An IN_MOVED_FROM event is held until the IN_MOVED_TO event with the
+ * same cookie arrives.  The kernel queues both at once, so if anything
+ * else comes first, or nothing comes within MOVE_PAIR_WINDOW
+ * milliseconds, the file was moved out of the watched tree, and the
+ * event is processed on its own.
+ */
+#define MOVE_PAIR_WINDOW 10
+
+static struct inotify_event *move_from;  /* Pending IN_MOVED_FROM event */
+static void *move_buf;                   /* Buffer keeping it */
+static size_t move_buf_size;             /* Size of the buffer */
+static struct timespec move_from_time;   /* Time it was read */
+
+static void
+move_hold(struct inotify_event *ep)
+{
+	size_t size = sizeof(*ep) + ep->len;
+
+	if (size > move_buf_size) {
+		move_buf = erealloc(move_buf, size);
+		move_buf_size = size;
+	}
+	memcpy(move_buf, ep, size);
+	move_from = move_buf;
+	clock_gettime(CLOCK_MONOTONIC, &move_from_time);
+}
+
+/* Process the pending IN_MOVED_FROM event on its own. */
+static void
+move_flush(void)
+{
+	struct inotify_event *ep = move_from;
+	move_from = NULL;
+	dispatch_event(ep, NULL);
+}
+
+/*
+ * Return the number of milliseconds left until the pairing window of
+ * the pending IN_MOVED_FROM event expires, or -1 if there is none.
+ */
+static int
+move_timeout(void)
+{
+	struct timespec now;
+	unsigned long long elapsed;
+
+	if (!move_from)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = timespec_diff_usec(&now, &move_from_time) / 1000;
+	return elapsed >= MOVE_PAIR_WINDOW ? 0 : MOVE_PAIR_WINDOW - elapsed;
+}
+
+static void
+process_move(struct inotify_event *from, struct inotify_event *to)
+{
+	struct move_pair mv;
+
+	mv.src = wpget(from->wd);
+	mv.dst = wpget(to->wd);
+	if (!mv.src || !mv.dst) {
+		dispatch_event(from, NULL);
+		dispatch_event(to, NULL);
+		return;
+	}
+	mv.oldname = from->name;
+	mv.newname = to->name;
+	mv.oldfile = mkfilename(mv.src->dirname, from->name);
+	if (!mv.oldfile)
+		nomem_abend();
+	mv.inplace = (from->mask & IN_ISDIR)
+		     && watchpoint_move(mv.src, from->name,
+					mv.dst, to->name) == 0;
+	debug(1, (_("%s moved to %s/%s%s"), mv.oldfile, mv.dst->dirname,
+		  to->name, mv.inplace ? _(" (watchers renamed)") : ""));
+	dispatch_event(from, &mv);
+	dispatch_event(to, &mv);
+	free(mv.oldfile);
+}
+
+static void
+process_event(struct inotify_event *ep)
+{
+	if (move_from) {
+		if ((ep->mask & IN_MOVED_TO) && ep->cookie == move_from->cookie) {
+			struct inotify_event *from = move_from;
+			move_from = NULL;
+			process_move(from, ep);
+			return;
+		}
+		move_flush();
+	}
+	if ((ep->mask & IN_MOVED_FROM) && ep->cookie) {
+		move_hold(ep);
+		return;
+	}
+	dispatch_event(ep, NULL);
+}
 
 int
 sysev_select()
@@ -299,10 +552,22 @@ sysev_select()
 	size_t size;
 	ssize_t rdbytes;
 
-	rdbytes = read(ifd, buffer, sizeof(buffer));
+	/* Don't block while directory scans are pending */
+	switch (capture_poll(ifd, scan_pending() ? 0 : move_timeout())) {
+	case 0:
+		if (move_from && move_timeout() == 0)
+			move_flush();
+		return 0;
+	case 1:
+		rdbytes = read(ifd, buffer, sizeof(buffer));
+		break;
+	default:
+		rdbytes = -1;
+	}
 	if (rdbytes == -1) {
 		if (errno == EINTR) {
-			if (!signo || signo == SIGCHLD || signo == SIGALRM)
+			if (!signo || signo == SIGCHLD || signo == SIGALRM
+			    || signo == SIGUSR2 || signo == SIGHUP)
 				return 0;
 			diag(LOG_NOTICE, _("got signal %d"), signo);
 			return 1;
@@ -311,15 +576,18 @@ sysev_select()
 		diag(LOG_NOTICE, _("read failed: %s"), strerror(errno));
 		return 1;
 	}
-		
+
+	stats_event_read();
 	ep = (struct inotify_event *) buffer;
 	while (rdbytes) {
+		stat_events++;
 		if (ep->wd >= 0)
 			process_event(ep);
 		size = sizeof(*ep) + ep->len;
 		ep = (struct inotify_event *) ((char*) ep + size);
 		rdbytes -= size;
 	}
+	stats_event_done();
 	
 	return 0;
 }
@@ -72,12 +72,37 @@ sysev_init()
 	chtab = calloc(sysconf(_SC_OPEN_MAX), sizeof(chtab[0]));
 }
 
+/* Number of descriptors not to be used for watches */
+#define FD_RESERVE 64
+
+size_t
+sysev_watch_limit(void)
+{
+	long n = sysconf(_SC_OPEN_MAX);
+	return n > FD_RESERVE ? n - FD_RESERVE : 0;
+}
+
 int
 sysev_filemask(struct watchpoint *dp)
 {
 	return S_IFMT;
 }
 
+static int
+kq_sysmask(struct watchpoint *wpt, event_mask *mask, int isdir)
+{
+	int sysmask = evtrans_gen_to_sys(mask, genev_xlat) | NOTE_DELETE;
+#if defined(NOTE_CLOSE_WRITE)
+	if (mask->gen_mask & GENEV_CHANGE) {
+		sysmask |= GENEV_WRITE_TRANSLATION | NOTE_CLOSE_WRITE;
+		wpt->file_changed = 0;
+	}
+#endif
+	if (isdir && (mask->gen_mask & GENEV_CREATE))
+		sysmask |= NOTE_WRITE;
+	return sysmask;
+}
+
 int
 sysev_add_watch(struct watchpoint *wpt, event_mask mask)
 {
@@ -91,15 +116,7 @@ sysev_add_watch(struct watchpoint *wpt, event_mask mask)
 			return -1;
 		}
 		wpt->file_ctime = st.st_ctime;
-		sysmask = evtrans_gen_to_sys(&mask, genev_xlat) | NOTE_DELETE;
-#if defined(NOTE_CLOSE_WRITE)
-		if (mask.gen_mask & GENEV_CHANGE) {
-			sysmask |= GENEV_WRITE_TRANSLATION | NOTE_CLOSE_WRITE;
-			wpt->file_changed = 0;
-		}
-#endif
-		if (S_ISDIR(st.st_mode) && (mask.gen_mask & GENEV_CREATE))
-			sysmask |= NOTE_WRITE;
+		sysmask = kq_sysmask(wpt, &mask, S_ISDIR(st.st_mode));
 		EV_SET(chtab + chcnt, wd, EVFILT_VNODE,
 		       EV_ADD | EV_ENABLE | EV_CLEAR, sysmask,
 		       0, wpt);
@@ -111,6 +128,24 @@ sysev_add_watch(struct watchpoint *wpt, event_mask mask)
 	return wd;
 }
 
+/* Change event mask of an existing watchpoint */
+int
+sysev_mod_watch(struct watchpoint *wpt, event_mask mask)
+{
+	struct kevent *kev = chtab + wpt->wd;
+
+	kev->fflags = kq_sysmask(wpt, &mask, wpt->isdir);
+	kev->flags = EV_ADD | EV_ENABLE | EV_CLEAR;
+	return kevent(kq, kev, 1, NULL, 0, NULL) == -1 ? -1 : 0;
+}
+
+/* Log statistics of the backend */
+void
+sysev_stats(void)
+{
+	diag(LOG_INFO, _("kqueue: %d watches"), chcnt);
+}
+
 void
 sysev_rm_watch(struct watchpoint *wpt)
 {
@@ -182,7 +217,7 @@ check_created(struct watchpoint *dp)
 			continue;
 		}
 
-		if (stat(pathname, &st)) {
+		if (dirent_stat(dir, dp->dirname, ent->d_name, &st, 1)) {
 			diag(LOG_ERR, "cannot stat %s: %s",
 			     pathname, strerror(errno));
 		/* If ok, first see if the file is newer than the last
@@ -261,10 +296,20 @@ sysev_select()
 	int i, n;
 	
 	chclosed_elim();
-	n = kevent(kq, chtab, chcnt, evtab, chcnt, NULL);
+	/* Don't block while directory scans are pending */
+	switch (capture_poll(kq, scan_pending() ? 0 : -1)) {
+	case 0:
+		return 0;
+	case 1:
+		n = kevent(kq, chtab, chcnt, evtab, chcnt, NULL);
+		break;
+	default:
+		n = -1;
+	}
 	if (n == -1) {
 		if (errno == EINTR) {
-			if (signo == 0 || signo == SIGCHLD || signo == SIGALRM)
+			if (signo == 0 || signo == SIGCHLD || signo == SIGALRM
+			    || signo == SIGUSR2 || signo == SIGHUP)
 				return 0;
 			diag(LOG_NOTICE, "got signal %d", signo);
 		}
@@ -272,8 +317,12 @@ sysev_select()
 		return 1;
 	} 
 
+	stats_event_read();
+	stat_events += n;
+
 	for (i = 0; i < n; i++) 
 		process_event(&evtab[i]);
+	stats_event_done();
 		
 	return 0;
 }
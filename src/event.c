@@ -38,7 +38,9 @@ evtempty(event_mask *mask)
 void
 evtfill(event_mask *mask)
 {
-	mask->gen_mask = trans_fullmask(genev_transtab);
+	/* The move event replaces create for the handlers that accept it,
+	   so it must be requested explicitly */
+	mask->gen_mask = trans_fullmask(genev_transtab) & ~GENEV_MOVE;
 	mask->sys_mask = trans_fullmask(sysev_transtab);
 }
 
@@ -56,12 +58,17 @@ evtnullp(event_mask *mask)
 	return mask->gen_mask == 0 && mask->sys_mask == 0;
 }
 
+/* Limits of the table of files changed but not yet closed */
+size_t change_max = CHANGE_MAX_DEFAULT;
+unsigned change_ttl;
+
 struct transtab genev_transtab[] = {
 	{ "create", GENEV_CREATE },
 	{ "write",  GENEV_WRITE  },
 	{ "attrib", GENEV_ATTRIB },
 	{ "delete", GENEV_DELETE },
 	{ "change", GENEV_CHANGE },
+	{ "move",   GENEV_MOVE   },
 	{ NULL }
 };
 
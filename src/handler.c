@@ -16,6 +16,7 @@
 
 #include "direvent.h"
 #include <grecs.h>
+#include <fcntl.h>
 
 struct handler *
 handler_alloc(event_mask ev_mask)
@@ -26,6 +27,274 @@ handler_alloc(event_mask ev_mask)
 	return hp;
 }
 
+static int
+handler_is_temp(struct handler *hp, const char *name)
+{
+	return !filpatlist_is_empty(hp->tnames)
+		&& filpatlist_match(hp->tnames, name) == 0;
+}
+
+/*
+ * Return 0 if the handler HP acts on the file NAME, i.e. if NAME
+ * matches its file patterns and is not a temporary file name.
+ */
+int
+handler_file_match(struct handler *hp, const char *name)
+{
+	if (filpatlist_match(hp->fnames, name))
+		return 1;
+	return handler_is_temp(hp, name);
+}
+
+/*
+ * Return 1 if the handler HP excludes the subdirectory NAME, whose
+ * pathname relative to the watched directory is RELPATH.
+ */
+int
+handler_excludes(struct handler *hp, const char *name, const char *relpath)
+{
+	if (filpatlist_is_empty(hp->xnames))
+		return 0;
+	return filpatlist_match(hp->xnames, name) == 0
+		|| filpatlist_match(hp->xnames, relpath) == 0;
+}
+
+/*
+ * Attribute filters.
+ *
+ * An unset upper limit is represented by the maximum value of its type,
+ * so that a filter with all members at their initial values accepts any
+ * file.
+ */
+void
+attrfilter_init(struct attrfilter *af)
+{
+	memset(af, 0, sizeof(*af));
+	af->max_size = (size_t) -1;
+	af->max_age = (unsigned) -1;
+}
+
+int
+attrfilter_is_empty(struct attrfilter const *af)
+{
+	return af->types == 0
+		&& af->min_size == 0 && af->max_size == (size_t) -1
+		&& af->uidc == 0 && af->gidc == 0
+		&& af->mode == 0
+		&& af->min_age == 0 && af->max_age == (unsigned) -1
+		&& af->sigc == 0;
+}
+
+void
+attrfilter_free(struct attrfilter *af)
+{
+	free(af->uidv);
+	free(af->gidv);
+	free(af->sigv);
+	attrfilter_init(af);
+}
+
+static int
+file_type(mode_t mode)
+{
+	if (S_ISREG(mode))
+		return FT_REG;
+	if (S_ISDIR(mode))
+		return FT_DIR;
+	if (S_ISLNK(mode))
+		return FT_LNK;
+	if (S_ISFIFO(mode))
+		return FT_FIFO;
+	if (S_ISSOCK(mode))
+		return FT_SOCK;
+	if (S_ISCHR(mode))
+		return FT_CHR;
+	if (S_ISBLK(mode))
+		return FT_BLK;
+	return 0;
+}
+
+/*
+ * Return the attributes of the file ES refers to, or NULL if it does
+ * not exist.  The file is looked up once, when the first handler with
+ * a filter needs it, and the result is shared by the rest.  Symbolic
+ * links are not followed.
+ */
+static struct stat *
+evstat_get(struct evstat *es)
+{
+	if (es->state == 0) {
+		char *name = mkfilename(es->dirname, es->filename);
+
+		if (!name)
+			nomem_abend();
+		if (lstat(name, &es->st) == 0)
+			es->state = 1;
+		else {
+			if (errno != ENOENT)
+				diag(LOG_ERR, _("cannot stat %s: %s"),
+				     name, strerror(errno));
+			es->state = -1;
+		}
+		free(name);
+	}
+	return es->state == 1 ? &es->st : NULL;
+}
+
+/*
+ * Read the first bytes of the regular file ES refers to, unless it was
+ * already done for this event.  Return 0 on success.
+ */
+static int
+evstat_head(struct evstat *es)
+{
+	if (es->head_state == 0) {
+		char *name = mkfilename(es->dirname, es->filename);
+		int fd;
+		ssize_t n;
+
+		if (!name)
+			nomem_abend();
+		es->head_state = -1;
+		fd = open(name, O_RDONLY | O_NONBLOCK | O_NOCTTY);
+		if (fd == -1) {
+			/* The file may be gone since the event */
+			if (errno != ENOENT)
+				diag(LOG_ERR, _("cannot open %s: %s"),
+				     name, strerror(errno));
+		} else {
+			n = pread(fd, es->head, sizeof(es->head), 0);
+			if (n == -1)
+				diag(LOG_ERR, _("error reading %s: %s"),
+				     name, strerror(errno));
+			else {
+				es->headlen = n;
+				es->head_state = 1;
+			}
+			close(fd);
+		}
+		free(name);
+	}
+	return es->head_state != 1;
+}
+
+/* Return 1 if the head of the file ES refers to matches one of the
+   signatures of AF. */
+static int
+content_match(struct attrfilter *af, struct evstat *es)
+{
+	size_t i;
+
+	if (evstat_head(es))
+		return 0;
+	for (i = 0; i < af->sigc; i++) {
+		struct signature *sig = &af->sigv[i];
+		if (sig->len <= es->headlen
+		    && sig->bytes[0] == es->head[0]
+		    && memcmp(sig->bytes, es->head, sig->len) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Return 0 if the file ES refers to satisfies the attribute filter of
+ * the handler HP.  A file that no longer exists (e.g. on delete) can't
+ * be checked and is always accepted.
+ */
+int
+handler_attr_match(struct handler *hp, struct evstat *es)
+{
+	struct attrfilter *af = hp->filter;
+	struct stat *st;
+	time_t age;
+	size_t i;
+
+	if (!af || !(st = evstat_get(es)))
+		return 0;
+	if (af->types && !(af->types & file_type(st->st_mode)))
+		return 1;
+	if ((size_t) st->st_size < af->min_size
+	    || (size_t) st->st_size > af->max_size)
+		return 1;
+	if (af->uidc) {
+		for (i = 0; i < af->uidc; i++)
+			if (af->uidv[i] == st->st_uid)
+				break;
+		if (i == af->uidc)
+			return 1;
+	}
+	if (af->gidc) {
+		for (i = 0; i < af->gidc; i++)
+			if (af->gidv[i] == st->st_gid)
+				break;
+		if (i == af->gidc)
+			return 1;
+	}
+	if ((st->st_mode & af->mode) != af->mode)
+		return 1;
+	age = time(NULL) - st->st_mtime;
+	if (age < 0)
+		age = 0;
+	if (age < af->min_age || age > af->max_age)
+		return 1;
+	/* Content signatures are checked last, as it takes a read */
+	if (af->sigc
+	    && (!S_ISREG(st->st_mode) || !content_match(af, es)))
+		return 1;
+	return 0;
+}
+
+/*
+ * Compute the content digest of the file ES refers to in WP and record
+ * it, unless it was already done for this event.  Return 0 on success.
+ */
+static int
+evstat_digest(struct watchpoint *wp, struct evstat *es)
+{
+	if (es->digest_state == 0) {
+		char *name = mkfilename(es->dirname, es->filename);
+		uint64_t digest;
+
+		if (!name)
+			nomem_abend();
+		es->digest_state = -1;
+		if (file_digest(name, &digest) == 0) {
+			snprintf(es->digest, sizeof(es->digest), "%016llx",
+				 (unsigned long long) digest);
+			es->digest_same = digest_update(wp, es->filename,
+							digest);
+			es->digest_state = 1;
+		}
+		free(name);
+	}
+	return es->digest_state != 1;
+}
+
+/*
+ * Run the handler HP for the event M on FILENAME in WP.  If the handler
+ * wants the content digest and the event is a change, compute it first
+ * and pass it to the handler in event_digest.  If the content did not
+ * change and the handler asked for that, don't run it at all.
+ */
+void
+handler_dispatch(struct watchpoint *wp, struct handler *hp, event_mask *m,
+		 const char *dirname, const char *filename,
+		 struct evstat *es)
+{
+	if (hp->digest && (m->gen_mask & GENEV_CHANGE)
+	    && evstat_digest(wp, es) == 0) {
+		if ((hp->digest & HD_CHANGED) && es->digest_same) {
+			debug(1, (_("%s/%s: content unchanged"),
+				  dirname, filename));
+			return;
+		}
+		event_digest = es->digest;
+	}
+	hp->run(wp, m, dirname, filename, hp->data, 1);
+	event_digest = NULL;
+}
+
 void
 watchpoint_run_handlers(struct watchpoint *wp, event_mask event,
 			const char *dirname, const char *filename)
@@ -33,15 +302,98 @@ watchpoint_run_handlers(struct watchpoint *wp, event_mask event,
 	handler_iterator_t itr;
 	struct handler *hp;
 	event_mask m;
+	struct evstat es = EVSTAT_INIT(dirname, filename);
 
+	wp->activity++;
+	if (event.gen_mask & GENEV_DELETE)
+		digest_forget(wp, filename);
 	for_each_handler(wp, itr, hp) {
 		if (evtand(&event, &hp->ev_mask, &m) &&
-		    filpatlist_match(hp->fnames, filename) == 0) {
-			hp->run(wp, &m, dirname, filename, hp->data, 1);
+		    handler_file_match(hp, filename) == 0 &&
+		    handler_attr_match(hp, &es) == 0) {
+			handler_dispatch(wp, hp, &m, dirname, filename, &es);
 		}
 	}
 }
 
+/* Full pathname of the source of the move being delivered, if any */
+char const *event_oldfile;
+
+static int
+watchpoint_has_handler(struct watchpoint *wp, struct handler *hp)
+{
+	handler_iterator_t itr;
+	struct handler *p;
+	int found = 0;
+
+	for_each_handler(wp, itr, p)
+		if (p == hp)
+			found = 1;
+	return found;
+}
+
+/*
+ * Run the handlers of WP for one half of a rename, whose other half was
+ * reported for PEERNAME in PEER.  If TO is 0, this is the source half:
+ * the handlers that accept the move event and act on PEERNAME in PEER
+ * as well are skipped, since they get it with the destination half.
+ * If TO is 1, this is the destination half: the handlers that accept
+ * the move event get it instead of create.  OLDFILE is the full
+ * pathname of the source.
+ *
+ * Events for temporary files are not delivered.  If a temporary file
+ * is renamed to a regular name (an atomic save), the handler gets a
+ * single change event for the new name, or create, if it does not
+ * accept change.
+ */
+void
+watchpoint_run_move_handlers(struct watchpoint *wp, event_mask event,
+			     const char *dirname, const char *filename,
+			     struct watchpoint *peer,
+			     const char *peername, int to,
+			     const char *oldfile)
+{
+	handler_iterator_t itr;
+	struct handler *hp;
+	event_mask m;
+	struct evstat es = EVSTAT_INIT(dirname, filename);
+
+	wp->activity++;
+	if (!to)
+		digest_forget(wp, filename);
+	for_each_handler(wp, itr, hp) {
+		if (handler_file_match(hp, filename)
+		    || handler_attr_match(hp, &es))
+			continue;
+		if (to && handler_is_temp(hp, peername)) {
+			if (hp->ev_mask.gen_mask & GENEV_CHANGE)
+				m.gen_mask = GENEV_CHANGE;
+			else
+				m.gen_mask = hp->ev_mask.gen_mask & GENEV_CREATE;
+			m.sys_mask = event.sys_mask & hp->ev_mask.sys_mask;
+			if (m.gen_mask)
+				handler_dispatch(wp, hp, &m, dirname, filename,
+						 &es);
+			continue;
+		}
+		if (hp->ev_mask.gen_mask & GENEV_MOVE) {
+			if (to) {
+				m.gen_mask = GENEV_MOVE;
+				m.sys_mask = event.sys_mask
+					     & hp->ev_mask.sys_mask;
+				event_oldfile = oldfile;
+				handler_dispatch(wp, hp, &m, dirname, filename, &es);
+				event_oldfile = NULL;
+				continue;
+			} else if (watchpoint_has_handler(peer, hp)
+				   && handler_file_match(hp, peername) == 0)
+				continue;
+		}
+		if (evtand(&event, &hp->ev_mask, &m))
+			handler_dispatch(wp, hp, &m, dirname, filename, &es);
+	}
+}
+
 static void
 handler_ref(struct handler *hp)
 {
@@ -52,6 +404,12 @@ void
 handler_free(struct handler *hp)
 {
 	filpatlist_destroy(&hp->fnames);
+	filpatlist_destroy(&hp->tnames);
+	filpatlist_destroy(&hp->xnames);
+	if (hp->filter) {
+		attrfilter_free(hp->filter);
+		free(hp->filter);
+	}
 	if (hp->free)
 		hp->free(hp->data);
 }
@@ -80,21 +438,92 @@ struct handler_list {
 	struct handler_iterator *itr_chain;
 };
 
+/*
+ * Iterator over the handlers of a watchpoint.  It traverses the user
+ * handler list first, and the sentinel list after it.
+ */
 struct handler_iterator {
 	struct handler_iterator *prev, *next;
 	handler_list_t hlist;
 	struct grecs_list_entry *ent;
 	int advanced;
+	struct watchpoint *wpt;     /* Watchpoint being iterated over */
+	int sentinels;              /* Iterating over its sentinel list */
 };
 
 static struct handler_iterator *itr_avail;
 
+/* Attach ITR to the iterator chain of HLIST and point it to its head */
+static void
+itr_attach(struct handler_iterator *itr, handler_list_t hlist)
+{
+	itr->prev = NULL;
+	itr->next = hlist->itr_chain;
+	itr->hlist = hlist;
+	if (hlist->itr_chain)
+	    hlist->itr_chain->prev = itr;
+	hlist->itr_chain = itr;
+	itr->ent = hlist->list->head;
+	itr->advanced = 0;
+}
+
+/* Remove ITR from the iterator chain of its list */
+static void
+itr_detach(struct handler_iterator *itr)
+{
+	struct handler_iterator *p;
+
+	if ((p = itr->prev) != NULL)
+		p->next = itr->next;
+	else
+		itr->hlist->itr_chain = itr->next;
+	if ((p = itr->next) != NULL)
+		p->prev = itr->prev;
+	itr->hlist = NULL;
+}
+
+static void
+itr_release(struct handler_iterator *itr)
+{
+	if (itr_avail)
+		itr_avail->prev = itr;
+	itr->prev = NULL;
+	itr->next = itr_avail;
+	itr->hlist = NULL;
+	itr_avail = itr;
+}
+
+/*
+ * If the current list of *PITR is exhausted, switch to the sentinel
+ * list.  When both are exhausted, release the iterator and set *PITR to
+ * NULL.  Return the current handler.
+ */
+static struct handler *
+itr_settle(handler_iterator_t *pitr)
+{
+	struct handler_iterator *itr = *pitr;
+
+	while (!itr->ent) {
+		if (itr->hlist)
+			itr_detach(itr);
+		if (!itr->sentinels && itr->wpt->sentinel_list) {
+			itr->sentinels = 1;
+			itr_attach(itr, itr->wpt->sentinel_list);
+		} else {
+			itr_release(itr);
+			*pitr = NULL;
+			return NULL;
+		}
+	}
+	return handler_itr_current(itr);
+}
+
 struct handler *
 handler_itr_first(struct watchpoint *wpt, handler_iterator_t *ret_itr)
 {
 	struct handler_iterator *itr;
 		
-	if (!wpt->handler_list)
+	if (!wpt->handler_list && !wpt->sentinel_list)
 		return NULL;
 
 	if (itr_avail) {
@@ -105,17 +534,16 @@ handler_itr_first(struct watchpoint *wpt, handler_iterator_t *ret_itr)
 	} else 
 		itr = emalloc(sizeof *itr);
 
-	itr->prev = NULL;
-	itr->next = wpt->handler_list->itr_chain;
-	itr->hlist = wpt->handler_list;
-	if (wpt->handler_list->itr_chain)
-	    wpt->handler_list->itr_chain->prev = itr;
-	wpt->handler_list->itr_chain = itr;
-
-	itr->ent = wpt->handler_list->list->head;
-	itr->advanced = 0;
+	itr->wpt = wpt;
+	if (wpt->handler_list) {
+		itr->sentinels = 0;
+		itr_attach(itr, wpt->handler_list);
+	} else {
+		itr->sentinels = 1;
+		itr_attach(itr, wpt->sentinel_list);
+	}
 	*ret_itr = itr;
-	return handler_itr_current(itr);
+	return itr_settle(ret_itr);
 }
 
 struct handler *
@@ -129,28 +557,7 @@ handler_itr_next(handler_iterator_t *pitr)
 		itr->advanced = 0;
 	else 
 		itr->ent = itr->ent->next;
-
-	if (!itr->ent) {
-		/* Remove from iterator chain */
-		struct handler_iterator *p;
-		if ((p = itr->prev) != NULL)
-			p->next = itr->next;
-		else
-			itr->hlist->itr_chain = itr->next;
-		if ((p = itr->next) != NULL)
-			p->prev = itr->prev;
-			
-		/* Add to the available chain */
-		if (itr_avail)
-			itr_avail->prev = itr;
-		itr->prev = NULL;
-		itr->next = itr_avail;
-		itr->hlist = NULL;
-		itr_avail = itr;
-		*pitr = NULL;
-		return NULL;
-	}
-	return handler_itr_current(itr);
+	return itr_settle(pitr);
 }
 		
 struct handler *
@@ -198,19 +605,6 @@ handler_list_unref(handler_list_t hlist)
 	}
 }
 
-static void
-handler_list_dup(handler_list_t *phlist)
-{
-	handler_list_t hlist = handler_list_create();
-	struct grecs_list_entry *ent;
-	//FIXME: Use iterator?
-	//FIXME: Optimization: check for ent->data==hp and skip it
-	for (ent = (*phlist)->list->head; ent; ent = ent->next) {
-		handler_list_append(hlist, ent->data);
-	}
-	*phlist = hlist;
-}
-
 void
 handler_list_append(handler_list_t hlist, struct handler *hp)
 {
@@ -218,19 +612,6 @@ handler_list_append(handler_list_t hlist, struct handler *hp)
 	grecs_list_append(hlist->list, hp);
 }
 
-void
-handler_list_append_cow(handler_list_t *phlist, struct handler *hp)
-{
-	handler_list_t hlist = *phlist;
-	if (!hlist) {
-		hlist = *phlist = handler_list_create();
-	} else if (hlist->refcnt > 1) {
-		handler_list_dup(phlist);
-		hlist = *phlist;
-	}
-	handler_list_append(hlist, hp);
-}
-
 size_t
 handler_list_remove(handler_list_t hlist, struct handler *hp)
 {
@@ -254,38 +635,3 @@ handler_list_remove(handler_list_t hlist, struct handler *hp)
 	grecs_list_remove_entry(hlist->list, ep);
 	return grecs_list_size(hlist->list);
 }
-
-size_t
-handler_list_remove_cow(handler_list_t *phlist, struct handler *hp)
-{
-	handler_list_t hlist = *phlist;
-	struct grecs_list_entry *ep;
-
-	if (!hlist)
-		return 0;
-	else if (hlist->refcnt > 1) {
-		handler_list_dup(phlist);
-		hlist = *phlist;
-	}
-	
-	for (ep = hlist->list->head; ep; ep = ep->next)
-		if (ep->data == hp)
-			break;
-	if (!ep)
-		abort();
-
-		
-	if (hlist->itr_chain) {
-		struct handler_iterator *itr;
-
-		for (itr = hlist->itr_chain; itr; itr = itr->next)
-			if (itr->ent == ep) {
-				itr->ent = ep->next;
-				itr->advanced = 1;
-			}
-	}
-	
-	grecs_list_remove_entry(hlist->list, ep);
-	return grecs_list_size(hlist->list);
-}
-
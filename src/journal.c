@@ -0,0 +1,572 @@
+/* direvent - directory content watcher daemon
+   Copyright (C) 2012-2021 Sergey Poznyakoff
+
+   GNU direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   GNU direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "direvent.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/*
+ * Event journal.
+ *
+ * Each handler run is recorded in the journal before the handler is
+ * started and marked as done when it terminates successfully.  Records
+ * are appended to the file as soon as they are made, and synced to disk
+ * once per main loop iteration, so that all handlers started while
+ * processing a single batch of kernel events share one fsync.
+ *
+ * On startup, the runs that were not marked as done are restarted.
+ * This covers both the runs interrupted by a crash or restart and the
+ * runs whose handler failed.  A failed run is retried once: if it fails
+ * again when replayed, it is marked as done and dropped.
+ *
+ * When the journal grows past journal_max_size, it is compacted by
+ * rewriting the records of the handlers that are still running and of
+ * the runs that failed since startup.  At most JOURNAL_FAIL_MAX failed
+ * runs are kept: beyond that, the oldest ones are marked as done.  To
+ * avoid rewriting the journal on each flush when the retained records
+ * alone exceed journal_max_size, it is not compacted again until it
+ * doubles in size.
+ *
+ * Each record has the following format:
+ *
+ *   J<crc> <len> <payload>\n
+ *
+ * where <crc> is the CRC-32 of <payload> and <len> is its length, both
+ * as 8 hex digits.  Records with a wrong checksum, as well as a torn
+ * record at the end of the file, are ignored.  The payload is one of:
+ *
+ *   S <id> <gen_mask> <sys_mask> <dirlen>:<dir><filelen>:<file><cmdlen>:<cmd>
+ *   D <id>
+ *
+ * The former means "handler <cmd> started for <dir>/<file>", the latter
+ * "run <id> finished successfully".
+ */
+
+char *journal_file;
+size_t journal_max_size = 16*1024*1024;
+
+static int journal_fd = -1;
+static off_t journal_size;
+static off_t journal_compact_size;  /* Size after the last compaction */
+static unsigned long journal_next_id = 1;
+/* True if records were written since the last sync */
+static int journal_dirty;
+
+/* Record buffer */
+static char *jbuf;
+static size_t jbuf_len;
+static size_t jbuf_size;
+
+/* Runs restored from the journal */
+struct jrun {
+	unsigned long id;
+	int done;
+	char *payload;
+};
+static struct jrun *jrun_tab;
+static size_t jrun_count;
+static size_t jrun_max;
+/* IDs of the finished runs */
+static unsigned long *jdone_tab;
+static size_t jdone_count;
+static size_t jdone_max;
+/* Runs that failed since startup, to be retained on compaction */
+#define JOURNAL_FAIL_MAX 1024
+static struct jrun *jfail_tab;
+static size_t jfail_count;
+static size_t jfail_max;
+static int jfail_warned;             /* Table overflow was reported */
+
+static unsigned long
+crc32(unsigned char const *buf, size_t len)
+{
+	static unsigned long table[256];
+	unsigned long crc;
+
+	if (!table[1]) {
+		unsigned long i, j;
+		for (i = 0; i < 256; i++) {
+			crc = i;
+			for (j = 0; j < 8; j++)
+				crc = (crc & 1) ? 0xedb88320UL ^ (crc >> 1)
+						: crc >> 1;
+			table[i] = crc;
+		}
+	}
+	crc = 0xffffffffUL;
+	while (len--)
+		crc = table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffffUL;
+}
+
+#define JHDR_LEN 19 /* Length of the "J<crc> <len> " header */
+
+static void
+jbuf_put(char const *payload, size_t len)
+{
+	size_t need = jbuf_len + JHDR_LEN + len + 2;
+
+	if (need > jbuf_size) {
+		while (need > jbuf_size)
+			jbuf_size = jbuf_size ? 2 * jbuf_size : 4096;
+		jbuf = erealloc(jbuf, jbuf_size);
+	}
+	snprintf(jbuf + jbuf_len, JHDR_LEN + 1, "J%08lx %08lx ",
+		 crc32((unsigned char const *) payload, len),
+		 (unsigned long) len);
+	jbuf_len += JHDR_LEN;
+	memcpy(jbuf + jbuf_len, payload, len);
+	jbuf_len += len;
+	jbuf[jbuf_len++] = '\n';
+}
+
+static int
+full_write(int fd, char const *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Append the record PAYLOAD to the journal.  It is synced by
+   journal_flush. */
+static void
+journal_append(char const *payload, size_t len)
+{
+	jbuf_len = 0;
+	jbuf_put(payload, len);
+	if (full_write(journal_fd, jbuf, jbuf_len)) {
+		diag(LOG_ERR, _("error writing journal %s: %s"),
+		     journal_file, strerror(errno));
+	} else {
+		journal_size += jbuf_len;
+		journal_dirty = 1;
+	}
+	jbuf_len = 0;
+}
+
+static char *
+mkpayload(unsigned long id, event_mask const *event,
+	  char const *dir, char const *file, char const *cmd)
+{
+	size_t size = 3 * 32 + strlen(dir) + strlen(file) + strlen(cmd) + 32;
+	char *payload = emalloc(size);
+
+	snprintf(payload, size, "S %lu %d %d %lu:%s%lu:%s%lu:%s",
+		 id, event->gen_mask, event->sys_mask,
+		 (unsigned long) strlen(dir), dir,
+		 (unsigned long) strlen(file), file,
+		 (unsigned long) strlen(cmd), cmd);
+	return payload;
+}
+
+/*
+ * Record start of the handler CMD for the given event.  Returns the
+ * record ID, or 0 if journal is not enabled.  The record payload is
+ * returned in *RET_PAYLOAD, to be used for compaction.
+ */
+unsigned long
+journal_start(event_mask const *event, char const *dir, char const *file,
+	      char const *cmd, char **ret_payload)
+{
+	unsigned long id;
+	char *payload;
+
+	*ret_payload = NULL;
+	if (journal_fd == -1)
+		return 0;
+	id = journal_next_id++;
+	payload = mkpayload(id, event, dir, file, cmd);
+	journal_append(payload, strlen(payload));
+	*ret_payload = payload;
+	return id;
+}
+
+/* Mark the run ID as successfully finished. */
+void
+journal_done(unsigned long id)
+{
+	char payload[64];
+
+	if (journal_fd == -1 || id == 0)
+		return;
+	snprintf(payload, sizeof payload, "D %lu", id);
+	journal_append(payload, strlen(payload));
+}
+
+/*
+ * Note that the run ID, whose record is PAYLOAD, failed.  The run
+ * remains unfinished and will be replayed at the next startup.  Takes
+ * ownership of PAYLOAD.
+ */
+void
+journal_fail(unsigned long id, char *payload)
+{
+	if (journal_fd == -1 || id == 0 || !payload) {
+		free(payload);
+		return;
+	}
+	if (jfail_count == JOURNAL_FAIL_MAX) {
+		/* Give up the oldest failed run */
+		if (!jfail_warned) {
+			diag(LOG_WARNING,
+			     _("%s: more than %d failed runs; "
+			       "the oldest ones will not be replayed"),
+			     journal_file, JOURNAL_FAIL_MAX);
+			jfail_warned = 1;
+		}
+		debug(1, (_("%s: not replaying run %lu"),
+			  journal_file, jfail_tab[0].id));
+		journal_done(jfail_tab[0].id);
+		free(jfail_tab[0].payload);
+		memmove(jfail_tab, jfail_tab + 1,
+			--jfail_count * sizeof(jfail_tab[0]));
+	}
+	if (jfail_count == jfail_max) {
+		jfail_max = jfail_max ? 2 * jfail_max : 64;
+		jfail_tab = erealloc(jfail_tab,
+				     jfail_max * sizeof(jfail_tab[0]));
+	}
+	jfail_tab[jfail_count].id = id;
+	jfail_tab[jfail_count].done = 0;
+	jfail_tab[jfail_count].payload = payload;
+	jfail_count++;
+}
+
+/*
+ * Atomically replace the journal with the contents of the record
+ * buffer.
+ */
+static void
+journal_rewrite(void)
+{
+	char *tmpname;
+	int fd;
+
+	tmpname = emalloc(strlen(journal_file) + 5);
+	strcat(strcpy(tmpname, journal_file), ".tmp");
+	fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd == -1) {
+		diag(LOG_ERR, _("cannot create %s: %s"),
+		     tmpname, strerror(errno));
+	} else if (full_write(fd, jbuf, jbuf_len) || fsync(fd)) {
+		diag(LOG_ERR, _("error writing %s: %s"),
+		     tmpname, strerror(errno));
+		close(fd);
+		unlink(tmpname);
+	} else if (rename(tmpname, journal_file)) {
+		diag(LOG_ERR, _("cannot rename %s to %s: %s"),
+		     tmpname, journal_file, strerror(errno));
+		close(fd);
+		unlink(tmpname);
+	} else {
+		debug(1, (_("journal compacted: %lu bytes"),
+			  (unsigned long) jbuf_len));
+		close(journal_fd);
+		journal_fd = fd;
+		journal_size = jbuf_len;
+		journal_compact_size = jbuf_len;
+		journal_dirty = 0;
+	}
+	jbuf_len = 0;
+	free(tmpname);
+}
+
+static void
+journal_compact_put(unsigned long id, char const *payload, void *data)
+{
+	jbuf_put(payload, strlen(payload));
+}
+
+/*
+ * Compact the journal, retaining only the records of running handlers
+ * and failed runs.
+ */
+static void
+journal_compact(void)
+{
+	size_t i;
+
+	jbuf_len = 0;
+	process_journal_foreach(journal_compact_put, NULL);
+	for (i = 0; i < jfail_count; i++)
+		journal_compact_put(jfail_tab[i].id, jfail_tab[i].payload,
+				    NULL);
+	journal_rewrite();
+}
+
+/* Sync the records appended since the last call. */
+void
+journal_flush(void)
+{
+	if (journal_fd == -1 || !journal_dirty)
+		return;
+	if (fdatasync(journal_fd)) {
+		diag(LOG_ERR, _("error syncing journal %s: %s"),
+		     journal_file, strerror(errno));
+	}
+	journal_dirty = 0;
+	if (journal_size > journal_max_size
+	    && journal_size > 2 * journal_compact_size)
+		journal_compact();
+}
+
+static int
+jrun_cmp(void const *a, void const *b)
+{
+	struct jrun const *ja = a, *jb = b;
+	if (ja->id < jb->id)
+		return -1;
+	return ja->id > jb->id;
+}
+
+/* Mark finished runs.  Compaction doesn't preserve the record order. */
+static void
+jrun_mark_done(void)
+{
+	size_t i;
+
+	qsort(jrun_tab, jrun_count, sizeof(jrun_tab[0]), jrun_cmp);
+	for (i = 0; i < jdone_count; i++) {
+		struct jrun key, *jr;
+
+		key.id = jdone_tab[i];
+		jr = bsearch(&key, jrun_tab, jrun_count, sizeof(jrun_tab[0]),
+			     jrun_cmp);
+		if (jr)
+			jr->done = 1;
+	}
+	free(jdone_tab);
+	jdone_tab = NULL;
+	jdone_count = jdone_max = 0;
+}
+
+static void
+journal_parse_record(char *payload, size_t len)
+{
+	unsigned long id;
+	char *p;
+
+	errno = 0;
+	id = strtoul(payload + 2, &p, 10);
+	if (errno || len < 3 || payload[1] != ' ')
+		return;
+	if (id >= journal_next_id)
+		journal_next_id = id + 1;
+	switch (payload[0]) {
+	case 'S':
+		if (jrun_count == jrun_max) {
+			jrun_max = jrun_max ? 2 * jrun_max : 64;
+			jrun_tab = erealloc(jrun_tab,
+					    jrun_max * sizeof(jrun_tab[0]));
+		}
+		jrun_tab[jrun_count].id = id;
+		jrun_tab[jrun_count].done = 0;
+		jrun_tab[jrun_count].payload = emalloc(len + 1);
+		memcpy(jrun_tab[jrun_count].payload, payload, len);
+		jrun_tab[jrun_count].payload[len] = 0;
+		jrun_count++;
+		break;
+
+	case 'D':
+		if (jdone_count == jdone_max) {
+			jdone_max = jdone_max ? 2 * jdone_max : 64;
+			jdone_tab = erealloc(jdone_tab,
+					     jdone_max * sizeof(jdone_tab[0]));
+		}
+		jdone_tab[jdone_count++] = id;
+		break;
+	}
+}
+
+static void
+journal_parse(char *buf, size_t size)
+{
+	char *p = buf, *end = buf + size;
+
+	while (end - p > JHDR_LEN) {
+		unsigned long crc, len;
+		char *q;
+
+		if (*p != 'J')
+			break;
+		crc = strtoul(p + 1, &q, 16);
+		if (*q != ' ')
+			break;
+		len = strtoul(q + 1, &q, 16);
+		if (*q != ' ')
+			break;
+		q++;
+		if (len >= end - q || q[len] != '\n') {
+			/* Torn record at the end */
+			break;
+		}
+		if (crc32((unsigned char *) q, len) != crc)
+			diag(LOG_WARNING,
+			     _("%s: ignoring corrupted record at offset %lu"),
+			     journal_file, (unsigned long) (p - buf));
+		else
+			journal_parse_record(q, len);
+		p = q + len + 1;
+	}
+}
+
+/*
+ * Open the journal, read in the unfinished runs and compact it.
+ * The runs will be restarted by journal_replay.
+ */
+void
+journal_open(void)
+{
+	int fd;
+	struct stat st;
+	char *buf;
+	size_t i;
+
+	if (!journal_file)
+		return;
+	fd = open(journal_file, O_RDWR|O_CREAT, 0600);
+	if (fd == -1) {
+		diag(LOG_ERR, _("cannot open journal %s: %s"),
+		     journal_file, strerror(errno));
+		return;
+	}
+	if (fstat(fd, &st)) {
+		diag(LOG_ERR, _("cannot stat journal %s: %s"),
+		     journal_file, strerror(errno));
+		close(fd);
+		return;
+	}
+	if (st.st_size > 0) {
+		ssize_t n;
+
+		buf = emalloc(st.st_size);
+		n = read(fd, buf, st.st_size);
+		if (n < 0) {
+			diag(LOG_ERR, _("error reading journal %s: %s"),
+			     journal_file, strerror(errno));
+			n = 0;
+		}
+		journal_parse(buf, n);
+		free(buf);
+		jrun_mark_done();
+	}
+	journal_fd = fd;
+
+	/* Retain unfinished records only */
+	jbuf_len = 0;
+	for (i = 0; i < jrun_count; i++)
+		if (!jrun_tab[i].done)
+			jbuf_put(jrun_tab[i].payload,
+				 strlen(jrun_tab[i].payload));
+	journal_rewrite();
+}
+
+static char *
+getfield(char **pp)
+{
+	char *p;
+	unsigned long len;
+	char *ret;
+
+	errno = 0;
+	len = strtoul(*pp, &p, 10);
+	if (errno || *p != ':' || strlen(p + 1) < len)
+		return NULL;
+	p++;
+	ret = emalloc(len + 1);
+	memcpy(ret, p, len);
+	ret[len] = 0;
+	*pp = p + len;
+	return ret;
+}
+
+/* Restart the handler runs that were left unfinished. */
+void
+journal_replay(void)
+{
+	size_t i;
+
+	for (i = 0; i < jrun_count; i++) {
+		struct jrun *jr = &jrun_tab[i];
+		event_mask event;
+		unsigned long id;
+		char *p, *dir = NULL, *file = NULL, *cmd = NULL;
+
+		if (!jr->done) {
+			if (sscanf(jr->payload, "S %lu %d %d ", &id,
+				   &event.gen_mask, &event.sys_mask) != 3
+			    || (p = strchr(jr->payload + 2, ' ')) == NULL
+			    || (p = strchr(p + 1, ' ')) == NULL
+			    || (p = strchr(p + 1, ' ')) == NULL
+			    || (++p, (dir = getfield(&p)) == NULL)
+			    || (file = getfield(&p)) == NULL
+			    || (cmd = getfield(&p)) == NULL) {
+				diag(LOG_ERR,
+				     _("%s: malformed record %lu"),
+				     journal_file, jr->id);
+			} else if (access(dir, F_OK)) {
+				diag(LOG_NOTICE,
+				     _("%s: not replaying %s for %s/%s: %s"),
+				     journal_file, cmd, dir, file,
+				     strerror(errno));
+				journal_done(id);
+			} else {
+				diag(LOG_NOTICE,
+				     _("replaying %s for %s/%s"),
+				     cmd, dir, file);
+				if (prog_handler_replay(cmd, &event, dir, file,
+							id, jr->payload) == 0)
+					jr->payload = NULL;
+				else
+					journal_done(id);
+			}
+			free(dir);
+			free(file);
+			free(cmd);
+		}
+		free(jr->payload);
+	}
+	free(jrun_tab);
+	jrun_tab = NULL;
+	jrun_count = jrun_max = 0;
+	journal_flush();
+}
+
+void
+journal_close(void)
+{
+	size_t i;
+
+	if (journal_fd != -1) {
+		journal_flush();
+		close(journal_fd);
+		journal_fd = -1;
+	}
+	for (i = 0; i < jfail_count; i++)
+		free(jfail_tab[i].payload);
+	free(jfail_tab);
+	jfail_tab = NULL;
+	jfail_count = jfail_max = 0;
+}
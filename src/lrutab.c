@@ -0,0 +1,303 @@
+/* direvent - directory content watcher daemon
+   Copyright (C) 2012-2021 Sergey Poznyakoff
+
+   GNU direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   GNU direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "direvent.h"
+
+/*
+ * Bounded tables of per-file data.
+ *
+ * Entries are keyed by a watchpoint serial number and a file name, and
+ * can carry a fixed amount of user data.  The table holds at most MAX
+ * entries: when it is full, the least recently used entry is evicted.
+ * If TTL is not 0, entries not used for TTL seconds are expired as well.
+ *
+ * Entries are kept in a hash table with separate chaining, and are
+ * linked into a list in order of their last use, most recent first.
+ */
+
+struct lrutab_entry {
+	struct lrutab_entry *hnext;        /* Next entry in the hash chain */
+	struct lrutab_entry *prev, *next;  /* Links in the LRU list */
+	unsigned hash;                     /* Hash value */
+	unsigned long serial;              /* Watchpoint serial number */
+	time_t atime;                      /* Time of last use */
+	size_t size;                       /* Allocated size */
+	char *name;                        /* File name */
+	/* User data and the name follow */
+};
+
+#define ENTRY_DATA(ent) ((void*)((ent) + 1))
+
+struct lrutab {
+	char const *id;                    /* Table name, for statistics */
+	size_t datasize;                   /* Size of the user data */
+	size_t max;                        /* Max. number of entries */
+	time_t ttl;                        /* Expiration time */
+	struct lrutab_entry **tab;         /* Hash table */
+	size_t size;                       /* Number of hash buckets */
+	size_t count;                      /* Number of entries */
+	struct lrutab_entry *head, *tail;  /* LRU list */
+	/* Statistics */
+	size_t bytes;                      /* Memory used by entries */
+	unsigned long evicted;             /* Entries evicted when full */
+	unsigned long expired;             /* Entries expired after TTL */
+};
+
+#define LRUTAB_MIN_SIZE 64
+
+static unsigned
+lrutab_hash(unsigned long serial, char const *name)
+{
+	/* FNV-1a */
+	unsigned h = 2166136261U;
+
+	for (; *name; name++) {
+		h ^= (unsigned char) *name;
+		h *= 16777619U;
+	}
+	return h ^ (unsigned) (serial * 2654435761U);
+}
+
+struct lrutab *
+lrutab_create(char const *id, size_t datasize, size_t max, time_t ttl)
+{
+	struct lrutab *lt = ecalloc(1, sizeof(*lt));
+
+	lt->id = id;
+	/* Keep the name that follows the data suitably aligned */
+	lt->datasize = (datasize + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+	lt->max = max;
+	lt->ttl = ttl;
+	return lt;
+}
+
+static void
+lru_unlink(struct lrutab *lt, struct lrutab_entry *ent)
+{
+	if (ent->prev)
+		ent->prev->next = ent->next;
+	else
+		lt->head = ent->next;
+	if (ent->next)
+		ent->next->prev = ent->prev;
+	else
+		lt->tail = ent->prev;
+}
+
+static void
+lru_push(struct lrutab *lt, struct lrutab_entry *ent)
+{
+	ent->prev = NULL;
+	ent->next = lt->head;
+	if (lt->head)
+		lt->head->prev = ent;
+	else
+		lt->tail = ent;
+	lt->head = ent;
+}
+
+static void
+lrutab_rehash(struct lrutab *lt, size_t size)
+{
+	struct lrutab_entry **tab = ecalloc(size, sizeof(tab[0]));
+	size_t i;
+
+	for (i = 0; i < lt->size; i++) {
+		struct lrutab_entry *ent, *next;
+
+		for (ent = lt->tab[i]; ent; ent = next) {
+			next = ent->hnext;
+			ent->hnext = tab[ent->hash & (size - 1)];
+			tab[ent->hash & (size - 1)] = ent;
+		}
+	}
+	free(lt->tab);
+	lt->tab = tab;
+	lt->size = size;
+}
+
+static struct lrutab_entry **
+lrutab_find(struct lrutab *lt, unsigned hash, unsigned long serial,
+	    char const *name)
+{
+	struct lrutab_entry **pp;
+
+	if (!lt->tab)
+		return NULL;
+	for (pp = &lt->tab[hash & (lt->size - 1)]; *pp; pp = &(*pp)->hnext) {
+		struct lrutab_entry *ent = *pp;
+		if (ent->hash == hash && ent->serial == serial
+		    && strcmp(ent->name, name) == 0)
+			return pp;
+	}
+	return NULL;
+}
+
+/* Remove the entry *PP from the hash chain and free it. */
+static void
+lrutab_delete(struct lrutab *lt, struct lrutab_entry **pp)
+{
+	struct lrutab_entry *ent = *pp;
+
+	*pp = ent->hnext;
+	lru_unlink(lt, ent);
+	lt->count--;
+	lt->bytes -= ent->size;
+	free(ent);
+}
+
+static void
+lrutab_drop(struct lrutab *lt, struct lrutab_entry *ent)
+{
+	struct lrutab_entry **pp = lrutab_find(lt, ent->hash, ent->serial,
+					       ent->name);
+	lrutab_delete(lt, pp);
+}
+
+/*
+ * Change the limits of the table.  If the table holds more than MAX
+ * entries, the least recently used ones are evicted.
+ */
+void
+lrutab_set_limits(struct lrutab *lt, size_t max, time_t ttl)
+{
+	lt->max = max;
+	lt->ttl = ttl;
+	while (lt->max && lt->count > lt->max) {
+		lrutab_drop(lt, lt->tail);
+		lt->evicted++;
+	}
+}
+
+/* Expire the entries that have not been used for TTL seconds. */
+void
+lrutab_expire(struct lrutab *lt, time_t now)
+{
+	if (lt->ttl == 0)
+		return;
+	while (lt->tail && now - lt->tail->atime >= lt->ttl) {
+		lrutab_drop(lt, lt->tail);
+		lt->expired++;
+	}
+}
+
+/*
+ * Look up the entry for NAME in the watchpoint with the given SERIAL
+ * number.  If it is found, mark it as recently used and return its
+ * data.  Otherwise, return NULL.
+ */
+void *
+lrutab_lookup(struct lrutab *lt, unsigned long serial, char const *name)
+{
+	unsigned hash = lrutab_hash(serial, name);
+	struct lrutab_entry **pp = lrutab_find(lt, hash, serial, name);
+	struct lrutab_entry *ent;
+	time_t now;
+
+	if (!pp)
+		return NULL;
+	ent = *pp;
+	now = time(NULL);
+	if (lt->ttl && now - ent->atime >= lt->ttl) {
+		lrutab_delete(lt, pp);
+		lt->expired++;
+		return NULL;
+	}
+	ent->atime = now;
+	lru_unlink(lt, ent);
+	lru_push(lt, ent);
+	return ENTRY_DATA(ent);
+}
+
+/*
+ * Look up or create the entry for NAME in the watchpoint with the given
+ * SERIAL number, and mark it as recently used.  Return its data.  If
+ * PNEW is not NULL, set it to 1 if the entry was created and to 0
+ * otherwise.  The data of a created entry are zeroed.
+ */
+void *
+lrutab_install(struct lrutab *lt, unsigned long serial, char const *name,
+	       int *pnew)
+{
+	unsigned hash = lrutab_hash(serial, name);
+	struct lrutab_entry **pp, *ent;
+	time_t now = time(NULL);
+	size_t len;
+
+	lrutab_expire(lt, now);
+	pp = lrutab_find(lt, hash, serial, name);
+	if (pp) {
+		ent = *pp;
+		ent->atime = now;
+		lru_unlink(lt, ent);
+		lru_push(lt, ent);
+		if (pnew)
+			*pnew = 0;
+		return ENTRY_DATA(ent);
+	}
+
+	if (lt->max && lt->count >= lt->max) {
+		lrutab_drop(lt, lt->tail);
+		lt->evicted++;
+	}
+	if (lt->count >= lt->size)
+		lrutab_rehash(lt, lt->size ? 2 * lt->size : LRUTAB_MIN_SIZE);
+
+	len = strlen(name) + 1;
+	ent = ecalloc(1, sizeof(*ent) + lt->datasize + len);
+	ent->size = sizeof(*ent) + lt->datasize + len;
+	ent->hash = hash;
+	ent->serial = serial;
+	ent->atime = now;
+	ent->name = (char*) ENTRY_DATA(ent) + lt->datasize;
+	memcpy(ent->name, name, len);
+	ent->hnext = lt->tab[hash & (lt->size - 1)];
+	lt->tab[hash & (lt->size - 1)] = ent;
+	lru_push(lt, ent);
+	lt->count++;
+	lt->bytes += ent->size;
+	if (pnew)
+		*pnew = 1;
+	return ENTRY_DATA(ent);
+}
+
+/* Remove the entry for NAME.  Return 1 if it existed, 0 otherwise. */
+int
+lrutab_remove(struct lrutab *lt, unsigned long serial, char const *name)
+{
+	unsigned hash = lrutab_hash(serial, name);
+	struct lrutab_entry **pp = lrutab_find(lt, hash, serial, name);
+	int expired;
+
+	if (!pp)
+		return 0;
+	expired = lt->ttl && time(NULL) - (*pp)->atime >= lt->ttl;
+	lrutab_delete(lt, pp);
+	if (expired) {
+		lt->expired++;
+		return 0;
+	}
+	return 1;
+}
+
+void
+lrutab_stats(struct lrutab *lt)
+{
+	diag(LOG_INFO,
+	     _("%s: %lu entries (%lu bytes), %lu buckets, %lu evicted, %lu expired"),
+	     lt->id, (unsigned long) lt->count, (unsigned long) lt->bytes,
+	     (unsigned long) lt->size, lt->evicted, lt->expired);
+}
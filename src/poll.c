@@ -0,0 +1,801 @@
+/* direvent - directory content watcher daemon
+   Copyright (C) 2012-2021 Sergey Poznyakoff
+
+   GNU direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   GNU direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "direvent.h"
+#include <dirent.h>
+#include <sys/stat.h>
+
+/*
+ * Polling tier.
+ *
+ * The number of kernel watches is limited.  When the limit is reached,
+ * or the configured watch budget is used up, watchpoints are polled
+ * instead: the watched directory is read and its entries are compared
+ * with the ones seen by the previous scan.  The differences are
+ * reported as generic events, so that the handlers and sentinels work
+ * the same way as for kernel watches.  Watchers configured with
+ * "backend poll" are always polled, since the kernel does not report
+ * changes made by other clients of network file systems.
+ *
+ * Each watchpoint is scanned at its own interval.  It starts at
+ * poll_interval, doubles after each scan that found no changes, up to
+ * poll_max_interval, and drops back to poll_interval when a change is
+ * found.  Polled watchpoints are kept in a heap ordered by the time of
+ * their next scan.
+ *
+ * A directory whose modification and change times are the same as at
+ * the previous scan, and older than it, has no entries created, deleted
+ * or renamed, so it is not read again: its known entries are examined,
+ * or nothing at all if no handler wants write or attribute events.
+ * The number of entries examined per second can be limited by
+ * poll_budget; scans that do not fit are postponed.
+ *
+ * Kernel watches are given to the busiest watchpoints.  The number of
+ * events delivered to each watchpoint is counted and halved every
+ * POLL_REBALANCE_INTERVAL seconds.  At that time, the busiest polled
+ * watchpoints are promoted to kernel watches, if any are left, or in
+ * exchange for the least active kernel-watched ones.  Top-level
+ * watchpoints are never demoted.
+ */
+
+/* Maximum number of kernel watches to use (0 means the system limit) */
+size_t watch_budget;
+/* Minimum and maximum interval between two scans of a watchpoint */
+unsigned poll_interval = POLL_INTERVAL_DEFAULT;
+unsigned poll_max_interval = POLL_MAX_INTERVAL_DEFAULT;
+/* Maximum number of entries to examine per second (0 means no limit) */
+size_t poll_budget;
+
+/* State of a directory entry, as of the last scan */
+struct pollent {
+	char *name;
+	ino_t ino;
+	mode_t mode;
+	off_t size;
+	time_t mtime;
+	time_t ctime;
+};
+
+struct polldir {
+	size_t index;                   /* Index in the heap */
+	struct watchpoint *wpt;         /* Polled watchpoint */
+	time_t next_poll;               /* Time of the next scan */
+	unsigned interval;              /* Current scan interval */
+	time_t scan_time;               /* Time of the last full scan */
+	struct pollent self;            /* State of the watched directory */
+	struct pollent *ent;            /* Entries, sorted by name */
+	size_t nent;                    /* Number of entries */
+	int changed;                    /* Changes found by the last scan */
+	int scanning;                   /* Scan in progress */
+	int removed;                    /* Removed while scanning */
+};
+
+/* Heap of polled watchpoints, ordered by the time of the next scan */
+static struct polldir **poll_heap;
+static size_t poll_count;
+static size_t poll_heap_size;
+static time_t next_rebalance;
+static int limit_reported;
+/* Number of entries examined in the current second */
+static size_t budget_used;
+static time_t budget_time;
+
+/* Statistics */
+static unsigned long stat_scans;
+static unsigned long stat_skipped;
+static unsigned long stat_entries;
+static unsigned long stat_deferred;
+static unsigned long stat_promoted;
+static unsigned long stat_demoted;
+
+static void
+heap_set(size_t i, struct polldir *pd)
+{
+	poll_heap[i] = pd;
+	pd->index = i;
+}
+
+static void
+heap_up(size_t i)
+{
+	struct polldir *pd = poll_heap[i];
+
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (poll_heap[parent]->next_poll <= pd->next_poll)
+			break;
+		heap_set(i, poll_heap[parent]);
+		i = parent;
+	}
+	heap_set(i, pd);
+}
+
+static void
+heap_down(size_t i)
+{
+	struct polldir *pd = poll_heap[i];
+
+	for (;;) {
+		size_t child = 2 * i + 1;
+		if (child >= poll_count)
+			break;
+		if (child + 1 < poll_count
+		    && poll_heap[child + 1]->next_poll
+		       < poll_heap[child]->next_poll)
+			child++;
+		if (pd->next_poll <= poll_heap[child]->next_poll)
+			break;
+		heap_set(i, poll_heap[child]);
+		i = child;
+	}
+	heap_set(i, pd);
+}
+
+static void
+poll_enqueue(struct polldir *pd)
+{
+	if (poll_count == poll_heap_size) {
+		poll_heap_size = poll_heap_size ? 2 * poll_heap_size : 16;
+		poll_heap = erealloc(poll_heap,
+				     poll_heap_size * sizeof(poll_heap[0]));
+	}
+	heap_set(poll_count, pd);
+	heap_up(poll_count++);
+}
+
+static void
+poll_dequeue(struct polldir *pd)
+{
+	size_t i = pd->index;
+
+	if (--poll_count == i)
+		return;
+	heap_set(i, poll_heap[poll_count]);
+	heap_up(i);
+	heap_down(poll_heap[i]->index);
+}
+
+/* Schedule the next scan of PD. */
+static void
+poll_reschedule(struct polldir *pd, time_t next_poll)
+{
+	pd->next_poll = next_poll;
+	heap_up(pd->index);
+	heap_down(pd->index);
+}
+
+static void
+pollent_free(struct pollent *ent, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		free(ent[i].name);
+	free(ent);
+}
+
+static void
+polldir_free(struct polldir *pd)
+{
+	pollent_free(pd->ent, pd->nent);
+	free(pd);
+}
+
+static void
+pollent_set(struct pollent *ent, struct stat const *st)
+{
+	ent->ino = st->st_ino;
+	ent->mode = st->st_mode;
+	ent->size = st->st_size;
+	ent->mtime = st->st_mtime;
+	ent->ctime = st->st_ctime;
+}
+
+static int
+pollent_cmp(const void *a, const void *b)
+{
+	struct pollent const *enta = a;
+	struct pollent const *entb = b;
+	return strcmp(enta->name, entb->name);
+}
+
+/*
+ * Read the directory DIRNAME.  Store its entries, sorted by name, in
+ * *RET_ENT and their number in *RET_N.  Return 0 on success and -1 on
+ * error.
+ */
+static int
+poll_read_dir(char const *dirname, struct pollent **ret_ent, size_t *ret_n)
+{
+	DIR *dir;
+	struct dirent *dent;
+	struct pollent *ent = NULL;
+	size_t n = 0, size = 0;
+
+	dir = opendir(dirname);
+	if (!dir)
+		return -1;
+	while ((dent = readdir(dir))) {
+		struct stat st;
+
+		if (dent->d_name[0] == '.'
+		    && (dent->d_name[1] == 0
+			|| (dent->d_name[1] == '.' && dent->d_name[2] == 0)))
+			continue;
+		if (dirent_stat(dir, dirname, dent->d_name, &st, 0))
+			/* Removed since readdir */
+			continue;
+		if (n == size) {
+			size = size ? 2 * size : 16;
+			ent = erealloc(ent, size * sizeof(ent[0]));
+		}
+		ent[n].name = estrdup(dent->d_name);
+		pollent_set(&ent[n], &st);
+		n++;
+	}
+	closedir(dir);
+	qsort(ent, n, sizeof(ent[0]), pollent_cmp);
+	*ret_ent = ent;
+	*ret_n = n;
+	return 0;
+}
+
+/*
+ * Examine the entries of PD known from the previous scan, without
+ * reading the directory.  Store their new state in *RET_ENT and their
+ * number in *RET_N.  Return 0 on success and -1 on error.
+ */
+static int
+poll_restat(struct polldir *pd, struct pollent **ret_ent, size_t *ret_n)
+{
+	DIR *dir;
+	struct pollent *ent = NULL;
+	size_t i, n = 0;
+
+	dir = opendir(pd->wpt->dirname);
+	if (!dir)
+		return -1;
+	if (pd->nent)
+		ent = emalloc(pd->nent * sizeof(ent[0]));
+	for (i = 0; i < pd->nent; i++) {
+		struct stat st;
+
+		if (dirent_stat(dir, pd->wpt->dirname, pd->ent[i].name,
+				&st, 0) == 0) {
+			ent[n].name = estrdup(pd->ent[i].name);
+			pollent_set(&ent[n], &st);
+			n++;
+		}
+	}
+	closedir(dir);
+	*ret_ent = ent;
+	*ret_n = n;
+	return 0;
+}
+
+/* Return true if the handlers of WPT want events for existing files. */
+static int
+poll_wants_content(struct watchpoint *wpt)
+{
+	event_mask mask;
+
+	watchpoint_event_mask(wpt, &mask);
+	return mask.gen_mask & (GENEV_WRITE|GENEV_ATTRIB|GENEV_CHANGE);
+}
+
+/*
+ * Read the state of the file watched by PD.  Store the state of the
+ * file itself in *SELF, and the entries, if it is a directory, in
+ * *RET_ENT and *RET_N.  Unless FULL is set, the directory is not read
+ * if it did not change since the last full scan; *RET_SKIPPED is then
+ * set to 1 and the previous entries remain valid.  Return the number of
+ * entries examined, or 0 on error.
+ */
+static size_t
+poll_read(struct polldir *pd, time_t now, int full, struct pollent *self,
+	  struct pollent **ret_ent, size_t *ret_n, int *ret_skipped)
+{
+	struct watchpoint *wpt = pd->wpt;
+	struct stat st;
+
+	*ret_skipped = 0;
+	if (stat(wpt->dirname, &st))
+		return 0;
+	self->name = NULL;
+	pollent_set(self, &st);
+	if (!wpt->isdir) {
+		*ret_ent = emalloc(sizeof(**ret_ent));
+		**ret_ent = *self;
+		*ret_n = 1;
+		return 1;
+	}
+	if (!full
+	    && self->ino == pd->self.ino
+	    && self->mtime == pd->self.mtime
+	    && self->ctime == pd->self.ctime
+	    && self->mtime < pd->scan_time) {
+		/* No entries were created, deleted or renamed */
+		if (!poll_wants_content(wpt)) {
+			stat_skipped++;
+			*ret_ent = NULL;
+			*ret_n = 0;
+			*ret_skipped = 1;
+			return 1;
+		}
+		if (poll_restat(pd, ret_ent, ret_n))
+			return 0;
+		return *ret_n + 1;
+	}
+	if (poll_read_dir(wpt->dirname, ret_ent, ret_n))
+		return 0;
+	pd->scan_time = now;
+	return *ret_n + 1;
+}
+
+/* Deliver EVENT for entry NAME (NULL for a watched file) of PD. */
+static void
+poll_deliver(struct polldir *pd, int event, char const *name)
+{
+	struct watchpoint *wpt = pd->wpt;
+	event_mask m = { event, 0 };
+	char *dirname;
+	char const *filename;
+
+	pd->changed = 1;
+	if (pd->removed)
+		return;
+	if ((event & GENEV_CREATE) && name
+	    && watchpoint_recent_lookup(wpt, name)) {
+		debug(1, (_("%s/%s: ignoring CREATE event: already delivered"),
+			  wpt->dirname, name));
+		return;
+	}
+	if (name) {
+		dirname = wpt->dirname;
+		filename = name;
+	} else
+		filename = split_pathname(wpt, &dirname);
+	if (debug_level > 0)
+		ev_log(LOG_DEBUG, wpt, m, (char*) filename);
+	watchpoint_run_handlers(wpt, m, dirname, filename);
+	unsplit_pathname(wpt);
+}
+
+/* Stop watching the subdirectory NAME of WPT, if it is watched. */
+static void
+poll_remove_watcher(struct watchpoint *wpt, char const *name)
+{
+	char *pathname = mkfilename(wpt->dirname, name);
+	struct watchpoint *sub;
+
+	if (!pathname)
+		nomem_abend();
+	sub = watchpoint_lookup(pathname);
+	free(pathname);
+	if (sub && sub != wpt)
+		watchpoint_suspend(sub);
+}
+
+static void
+poll_compare_entry(struct polldir *pd, struct pollent *old,
+		   struct pollent *cur)
+{
+	char const *name = cur->name;
+
+	if (old->ino != cur->ino
+	    || (old->mode & S_IFMT) != (cur->mode & S_IFMT)) {
+		/* The name refers to another file now */
+		if (name && S_ISDIR(old->mode))
+			poll_remove_watcher(pd->wpt, name);
+		if ((old->mode & S_IFMT) != (cur->mode & S_IFMT))
+			poll_deliver(pd, GENEV_DELETE, name);
+		poll_deliver(pd, GENEV_CREATE, name);
+	} else if (!S_ISDIR(cur->mode)
+		   && (old->mtime != cur->mtime || old->size != cur->size))
+		/* The writer can't be followed to the close: report both */
+		poll_deliver(pd, GENEV_WRITE|GENEV_CHANGE, name);
+	else if (old->ctime != cur->ctime)
+		poll_deliver(pd, GENEV_ATTRIB, name);
+}
+
+/* Report the differences between the entries of PD and ENT. */
+static void
+poll_compare(struct polldir *pd, struct pollent *ent, size_t n)
+{
+	struct watchpoint *wpt = pd->wpt;
+	size_t i = 0, j = 0;
+
+	if (!wpt->isdir) {
+		poll_compare_entry(pd, pd->ent, ent);
+		return;
+	}
+	while (i < pd->nent || j < n) {
+		int c;
+
+		if (i == pd->nent)
+			c = 1;
+		else if (j == n)
+			c = -1;
+		else
+			c = strcmp(pd->ent[i].name, ent[j].name);
+
+		if (c < 0) {
+			char const *name = pd->ent[i].name;
+			poll_deliver(pd, GENEV_DELETE, name);
+			debug(1, (_("%s/%s deleted"), wpt->dirname, name));
+			if (!pd->removed)
+				poll_remove_watcher(wpt, name);
+			i++;
+		} else if (c > 0) {
+			debug(1, (_("%s/%s created"),
+				  wpt->dirname, ent[j].name));
+			poll_deliver(pd, GENEV_CREATE, ent[j].name);
+			j++;
+		} else {
+			poll_compare_entry(pd, &pd->ent[i], &ent[j]);
+			i++;
+			j++;
+		}
+	}
+}
+
+/*
+ * Scan the polled watchpoint PD, report the differences from the
+ * previous scan and schedule the next one.  Unless FULL is set, the
+ * directory is read only if it changed.  Return the number of entries
+ * examined.
+ */
+static size_t
+poll_scan(struct polldir *pd, time_t now, int full)
+{
+	struct watchpoint *wpt = pd->wpt;
+	struct pollent self, *ent;
+	size_t n, cost;
+	int skipped;
+
+	stat_scans++;
+	cost = poll_read(pd, now, full, &self, &ent, &n, &skipped);
+	if (cost == 0) {
+		if (errno == ENOENT || errno == ENOTDIR) {
+			debug(1, (_("%s deleted"), wpt->dirname));
+			watchpoint_suspend(wpt);
+		} else {
+			diag(LOG_ERR, _("cannot scan %s: %s"),
+			     wpt->dirname, strerror(errno));
+			poll_reschedule(pd, now + pd->interval);
+		}
+		return 1;
+	}
+	stat_entries += cost;
+	pd->self = self;
+	if (skipped) {
+		/* Unchanged directory, skipped */
+		pd->changed = 0;
+	} else {
+		watchpoint_ref(wpt);
+		pd->scanning = 1;
+		pd->changed = 0;
+		poll_compare(pd, ent, n);
+		pd->scanning = 0;
+
+		if (pd->removed) {
+			pollent_free(ent, n);
+			polldir_free(pd);
+			watchpoint_unref(wpt);
+			return cost;
+		}
+		pollent_free(pd->ent, pd->nent);
+		pd->ent = ent;
+		pd->nent = n;
+		watchpoint_unref(wpt);
+	}
+
+	/* Adapt the interval to the activity */
+	if (pd->changed)
+		pd->interval = poll_interval;
+	else if (pd->interval < poll_max_interval) {
+		pd->interval *= 2;
+		if (pd->interval > poll_max_interval)
+			pd->interval = poll_max_interval;
+	}
+	if (pd->interval < poll_interval)
+		pd->interval = poll_interval;
+	poll_reschedule(pd, now + pd->interval);
+	return cost;
+}
+
+/*
+ * Start polling WPT.  The current state of the watched file is read,
+ * but not reported.  Return 0 on success.
+ */
+int
+poll_add(struct watchpoint *wpt)
+{
+	struct polldir *pd;
+	time_t now = time(NULL);
+	int skipped;
+
+	pd = ecalloc(1, sizeof(*pd));
+	pd->wpt = wpt;
+	if (poll_read(pd, now, 1, &pd->self, &pd->ent, &pd->nent,
+		      &skipped) == 0) {
+		diag(LOG_ERR, _("cannot scan %s: %s"),
+		     wpt->dirname, strerror(errno));
+		free(pd);
+		return 1;
+	}
+	watchpoint_ref(wpt);
+	pd->interval = poll_interval;
+	pd->next_poll = now + pd->interval;
+	poll_enqueue(pd);
+	wpt->poll = pd;
+	debug(1, (_("%s: polling every %u seconds"),
+		  wpt->dirname, pd->interval));
+	if (next_rebalance == 0)
+		next_rebalance = now + POLL_REBALANCE_INTERVAL;
+	return 0;
+}
+
+/*
+ * Start polling WPT because no kernel watch could be set for it.
+ */
+int
+poll_fallback(struct watchpoint *wpt)
+{
+	if (!limit_reported) {
+		diag(LOG_WARNING,
+		     _("kernel watch limit reached (%lu watches in use); "
+		       "polling the rest"),
+		     (unsigned long) kernel_watches);
+		limit_reported = 1;
+	}
+	return poll_add(wpt);
+}
+
+/* Stop polling WPT. */
+void
+poll_remove(struct watchpoint *wpt)
+{
+	struct polldir *pd = wpt->poll;
+
+	if (!pd)
+		return;
+	wpt->poll = NULL;
+	poll_dequeue(pd);
+	if (pd->scanning)
+		pd->removed = 1;
+	else
+		polldir_free(pd);
+	watchpoint_unref(wpt);
+}
+
+/* Scan WPT now and report any changes since the last scan. */
+void
+poll_flush(struct watchpoint *wpt)
+{
+	if (wpt->poll)
+		poll_scan(wpt->poll, time(NULL), 1);
+}
+
+/*
+ * Return the maximum number of kernel watches, or 0 if it is not
+ * known.
+ */
+size_t
+watch_limit(void)
+{
+	return watch_budget ? watch_budget : sysev_watch_limit();
+}
+
+/* Return true if no kernel watches are left within the budget. */
+int
+watch_budget_exhausted(void)
+{
+	size_t limit = watch_limit();
+	return limit && kernel_watches >= limit;
+}
+
+/*
+ * Rebalancing.
+ */
+struct rebalance_closure {
+	struct watchpoint **wpv;
+	size_t wpc;
+	size_t wpn;
+};
+
+static void
+rebalance_add(struct rebalance_closure *clos, struct watchpoint *wpt)
+{
+	if (clos->wpc == clos->wpn) {
+		clos->wpn = clos->wpn ? 2 * clos->wpn : 16;
+		clos->wpv = erealloc(clos->wpv,
+				     clos->wpn * sizeof(clos->wpv[0]));
+	}
+	watchpoint_ref(wpt);
+	clos->wpv[clos->wpc++] = wpt;
+}
+
+static void
+rebalance_free(struct rebalance_closure *clos)
+{
+	size_t i;
+
+	for (i = 0; i < clos->wpc; i++)
+		watchpoint_unref(clos->wpv[i]);
+	free(clos->wpv);
+}
+
+static int
+collect_demotable(struct watchpoint *wpt, void *data)
+{
+	if (wpt->wd != -1 && wpt->parent)
+		rebalance_add(data, wpt);
+	return 0;
+}
+
+static int
+activity_decay(struct watchpoint *wpt, void *data)
+{
+	wpt->activity /= 2;
+	return 0;
+}
+
+/* Sort in order of decreasing activity */
+static int
+activity_cmp_desc(const void *a, const void *b)
+{
+	struct watchpoint *const *wpa = a;
+	struct watchpoint *const *wpb = b;
+
+	if ((*wpa)->activity > (*wpb)->activity)
+		return -1;
+	if ((*wpa)->activity < (*wpb)->activity)
+		return 1;
+	return 0;
+}
+
+/* Sort in order of increasing activity */
+static int
+activity_cmp_asc(const void *a, const void *b)
+{
+	return activity_cmp_desc(b, a);
+}
+
+static void
+poll_rebalance(void)
+{
+	struct rebalance_closure hot = { NULL, 0, 0 };
+	struct rebalance_closure cold = { NULL, 0, 0 };
+	size_t limit = watch_limit();
+	size_t i = 0, j = 0;
+
+	watchpoint_foreach(collect_demotable, &cold);
+	qsort(cold.wpv, cold.wpc, sizeof(cold.wpv[0]), activity_cmp_asc);
+
+	/* Give up the kernel watches beyond the budget */
+	while (limit && kernel_watches > limit && j < cold.wpc) {
+		if (watchpoint_demote(cold.wpv[j++]))
+			break;
+		stat_demoted++;
+	}
+
+	for (i = 0; i < poll_count; i++) {
+		struct watchpoint *wpt = poll_heap[i]->wpt;
+		if (wpt->activity > 0 && !watchpoint_poll_only(wpt))
+			rebalance_add(&hot, wpt);
+	}
+	i = 0;
+	qsort(hot.wpv, hot.wpc, sizeof(hot.wpv[0]), activity_cmp_desc);
+
+	/* Promote the busiest polled watchpoints while watches are left */
+	for (; i < hot.wpc && !watch_budget_exhausted(); i++) {
+		if (!hot.wpv[i]->poll)
+			continue;
+		if (watchpoint_promote(hot.wpv[i]))
+			break;
+		stat_promoted++;
+	}
+
+	/* Exchange the busiest polled ones for the least active ones */
+	for (; i < hot.wpc && j < cold.wpc; i++, j++) {
+		if (!hot.wpv[i]->poll || cold.wpv[j]->wd == -1)
+			continue;
+		if (hot.wpv[i]->activity <= 2 * cold.wpv[j]->activity)
+			break;
+		if (watchpoint_demote(cold.wpv[j]))
+			break;
+		stat_demoted++;
+		if (watchpoint_promote(hot.wpv[i]))
+			break;
+		stat_promoted++;
+	}
+
+	rebalance_free(&hot);
+	rebalance_free(&cold);
+
+	watchpoint_foreach(activity_decay, NULL);
+	if (stat_promoted || stat_demoted)
+		debug(1, (_("watch rebalance: %lu kernel watches, "
+			    "%lu polled; %lu promoted, %lu demoted so far"),
+			  (unsigned long) kernel_watches,
+			  (unsigned long) poll_count,
+			  stat_promoted, stat_demoted));
+}
+
+/*
+ * Scan the polled watchpoints that are due, within the budget, and
+ * rebalance the kernel watches if it is time.  Return the number of
+ * seconds until the next scan, or 0 if nothing is polled.
+ */
+int
+poll_timeouts(void)
+{
+	time_t now = time(NULL);
+	time_t d;
+
+	if (poll_count == 0)
+		return 0;
+
+	if (budget_time != now) {
+		budget_time = now;
+		budget_used = 0;
+	}
+	/* A scan reschedules the watchpoint into the future, so that each
+	   one is scanned at most once */
+	while (poll_count > 0 && poll_heap[0]->next_poll <= now) {
+		if (poll_budget && budget_used >= poll_budget) {
+			stat_deferred++;
+			break;
+		}
+		budget_used += poll_scan(poll_heap[0], now, 0);
+	}
+
+	if (now >= next_rebalance) {
+		poll_rebalance();
+		next_rebalance = now + POLL_REBALANCE_INTERVAL;
+	}
+
+	if (poll_count == 0)
+		return 0;
+	d = poll_heap[0]->next_poll;
+	if (next_rebalance < d)
+		d = next_rebalance;
+	d -= now;
+	return d > 0 ? d : 1;
+}
+
+void
+poll_stats(void)
+{
+	size_t limit = watch_limit();
+
+	if (limit)
+		diag(LOG_INFO,
+		     _("kernel watches: %lu in use, limit %lu"),
+		     (unsigned long) kernel_watches, (unsigned long) limit);
+	else
+		diag(LOG_INFO, _("kernel watches: %lu in use"),
+		     (unsigned long) kernel_watches);
+	diag(LOG_INFO,
+	     _("polling: %lu watchers, %lu scans (%lu skipped unchanged), "
+	       "%lu entries examined, %lu times over budget"),
+	     (unsigned long) poll_count, stat_scans, stat_skipped,
+	     stat_entries, stat_deferred);
+	diag(LOG_INFO,
+	     _("polling: %lu promoted to kernel watches, %lu demoted"),
+	     stat_promoted, stat_demoted);
+}
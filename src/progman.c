@@ -20,28 +20,28 @@
 #include <grp.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <ctype.h>
 #include <grecs.h>
 #include "wordsplit.h"
 
 /* Process list */
 
-/* Logger codes */
-#define LOGGER_OUT 0
-#define LOGGER_ERR 1
+/* Output capture codes */
+#define CAPTURE_OUT 0
+#define CAPTURE_ERR 1
 
 #define PROC_HANDLER  0
-#define PROC_LOGGER    1
 /* Special types for use in print_status: */
-#define PROC_SELFTEST 2
-#define PROC_FOREIGN  3
+#define PROC_SELFTEST 1
+#define PROC_FOREIGN  2
 
 static char const *
 process_type_string(int type)
 {
 	static char const *typestr[] = {
 		"handler",
-		"logger",
 		"self-test",
 		"foreign"
 	};
@@ -57,13 +57,12 @@ struct process {
 	unsigned timeout;       /* Timeout in seconds */
 	pid_t pid;              /* PID */
 	time_t start;           /* Time when the process started */
-	union {
-                /* Pointers to logger processes, if
-		   type == PROC_HANDLER (NULL if no logger) */
-		struct process *logger[2];
-                /* Master process, if type == PROC_LOGGER */
-		struct process *master;
-	} v;
+	struct prog_handler *handler; /* Handler, if type == PROC_HANDLER */
+	struct timespec ts_event; /* Time the triggering event was read */
+	struct timespec ts_fork;  /* Time the process was forked */
+	unsigned long jid;      /* Journal record ID (0 if none) */
+	char *jrec;             /* Journal record payload */
+	int replayed;           /* Run replayed from the journal */
 };
 
 /* List of running processes */
@@ -193,6 +192,48 @@ print_status(pid_t pid, int status, int type, sigset_t *mask)
 		     (unsigned long) pid, process_type_string(type));
 }
 
+static void prog_handler_unref(struct prog_handler *hp);
+
+/* Note the exit of a process of the handler HP.  When the last one
+   exits, start the grace period for its output files. */
+static void
+prog_handler_done(struct prog_handler *hp)
+{
+	if (--hp->running == 0 && !filpatlist_is_empty(hp->onames))
+		hp->quiet_until = time(NULL) + hp->output_grace;
+}
+
+/* Update latency statistics of the handler process P that has exited. */
+static void
+process_latency(struct process *p)
+{
+	struct prog_handler *hp = p->handler;
+	struct timespec now;
+	/* Runs not started by a kernel event have no dispatch latency */
+	int has_event = p->ts_event.tv_sec || p->ts_event.tv_nsec;
+
+	if (!hp)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (has_event) {
+		latency_hist_add(&hp->lat_dispatch,
+				 timespec_diff_usec(&p->ts_fork,
+						    &p->ts_event));
+		debug(2, (_("process %lu: dispatch latency %lluus"),
+			  (unsigned long) p->pid,
+			  timespec_diff_usec(&p->ts_fork, &p->ts_event)));
+	}
+	latency_hist_add(&hp->lat_run,
+			 timespec_diff_usec(&now, &p->ts_fork));
+	debug(2, (_("process %lu: run time %lluus"),
+		  (unsigned long) p->pid,
+		  timespec_diff_usec(&now, &p->ts_fork)));
+	trace_handler(hp->command, p->pid, has_event ? &p->ts_event : NULL,
+		      &p->ts_fork, &now);
+	p->handler = NULL;
+	prog_handler_unref(hp);
+}
+
 void
 process_cleanup(int expect_term)
 {
@@ -232,10 +273,25 @@ process_cleanup(int expect_term)
 				continue;
 
 			if (p->type == PROC_HANDLER) {
-				if (p->v.logger[LOGGER_OUT])
-					p->v.logger[LOGGER_OUT]->v.master = NULL;
-				if (p->v.logger[LOGGER_ERR])
-					p->v.logger[LOGGER_ERR]->v.master = NULL;
+				if (p->handler)
+					prog_handler_done(p->handler);
+				process_latency(p);
+				if (WIFEXITED(status)
+				    && WEXITSTATUS(status) == 0)
+					journal_done(p->jid);
+				else if (p->replayed) {
+					/* Retry failed runs only once */
+					diag(LOG_NOTICE,
+					     _("replayed process %lu failed "
+					       "again; not retrying"),
+					     (unsigned long) pid);
+					journal_done(p->jid);
+				} else {
+					journal_fail(p->jid, p->jrec);
+					p->jrec = NULL;
+				}
+				free(p->jrec);
+				p->jrec = NULL;
 			}
 			p->pid = 0;
 			proc_unlink(&proc_list, p);
@@ -244,6 +300,20 @@ process_cleanup(int expect_term)
 	}
 }
 
+/* Call FN for each running handler that has a journal record. */
+void
+process_journal_foreach(void (*fn)(unsigned long, char const *, void *),
+			void *data)
+{
+	struct process *p;
+
+	for (p = proc_list; p; p = p->next)
+		if (p->type == PROC_HANDLER && p->jrec)
+			fn(p->jid, p->jrec, data);
+}
+
+static time_t capture_timeouts(time_t now);
+
 void
 process_timeouts(void)
 {
@@ -251,6 +321,13 @@ process_timeouts(void)
 	time_t now = time(NULL);
 	time_t alarm_time = watchpoint_recent_cleanup(), x;
 
+	x = capture_timeouts(now);
+	if (x && (alarm_time == 0 || x < alarm_time))
+		alarm_time = x;
+	x = poll_timeouts();
+	if (x && (alarm_time == 0 || x < alarm_time))
+		alarm_time = x;
+
 	debug(3, (_("begin scanning process list")));
 	for (p = proc_list; p; p = p->next) {
 		x = now - p->start;
@@ -299,68 +376,207 @@ switchpriv(struct prog_handler *hp)
 	return 0;
 }		
 
-/* Operations with handlers and loggers */
+/* Capturing handler output */
+
+/*
+ * Standard output and error of handlers that have the "stdout" or
+ * "stderr" option are captured via non-blocking pipes, which are
+ * multiplexed with the event source in the main loop.  The output is
+ * split into lines and logged via diag.
+ */
+
+/* Maximum length of an output line.  Longer lines are split. */
+#define CAPTURE_LINE_MAX 1024
+
+struct capture {
+	struct capture *next;
+	int fd;                       /* Read end of the pipe */
+	int prio;                     /* Log priority */
+	struct prog_handler *handler; /* Handler that produced the output */
+	time_t deadline;              /* Close the capture after this time */
+	size_t len;                   /* Number of bytes in buf */
+	char buf[CAPTURE_LINE_MAX];   /* Incomplete line */
+};
+
+static struct capture *capture_list;
+static size_t capture_count;
 
 static void
-logger_exit(int sig)
+capture_log(struct capture *cp, char const *text, size_t len)
 {
-	_exit(0);
+	/* Log under the handler command name */
+	diag_set_ident(cp->handler->command);
+	diag(cp->prio, "%.*s", (int) len, text);
+	diag_set_ident(NULL);
 }
 
-int
-open_logger(const char *tag, int prio, struct process **return_proc)
+/*
+ * Create a capture for the output of handler HP, logged with priority
+ * PRIO.  Return the write end of the pipe, or -1 on error.
+ */
+static int
+capture_open(struct prog_handler *hp, int prio)
 {
 	int p[2];
-	FILE *fp;
-	char buf[512];
-	pid_t pid;
-	int i;
-	
+	struct capture *cp;
+
 	if (pipe(p)) {
 		diag(LOG_ERR,
-		     _("cannot start logger for %s, pipe failed: %s"),
-		     tag, strerror(errno));
+		     _("cannot capture output of %s, pipe failed: %s"),
+		     hp->command, strerror(errno));
 		return -1;
 	}
-	switch (pid = fork()) {
-	case 0:
-		/* Logger process */
-		close_fds(p[0] + 1);
-		for (i = 3; i < p[0]; i++)
-			close(i);
-		alarm(0);
-		signal_setup(logger_exit);
-
-		fp = fdopen(p[0], "r");
-		if (fp == NULL)
-			_exit(1);
-		if (facility > 0) 
-			openlog(tag, LOG_PID, facility);
-
-		while (fgets(buf, sizeof(buf), fp)) {
-			int len = strlen(buf);
-			if (len && buf[len-1] == '\n')
-				buf[len-1] = 0;
-			diag(prio, "%s", buf);
-		}
-		_exit(0);
-      
-	case -1:
-		diag(LOG_CRIT,
-		     _("cannot run logger `%s': fork failed: %s"),
-		     tag, strerror(errno));
+	fcntl(p[0], F_SETFL, fcntl(p[0], F_GETFL) | O_NONBLOCK);
+	fcntl(p[0], F_SETFD, FD_CLOEXEC);
+
+	cp = emalloc(sizeof(*cp));
+	cp->fd = p[0];
+	cp->prio = prio;
+	cp->handler = hp;
+	hp->refcnt++;
+	cp->deadline = time(NULL) + hp->timeout;
+	cp->len = 0;
+	cp->next = capture_list;
+	capture_list = cp;
+	capture_count++;
+
+	return p[1];
+}
+
+/* Remove the capture *PP from the list, logging any pending output. */
+static void
+capture_close(struct capture **pp)
+{
+	struct capture *cp = *pp;
+
+	if (cp->len)
+		capture_log(cp, cp->buf, cp->len);
+	close(cp->fd);
+	*pp = cp->next;
+	capture_count--;
+	prog_handler_unref(cp->handler);
+	free(cp);
+}
+
+/*
+ * Read available output from CP and log all complete lines.  Return 1
+ * if some data were read, 0 if none were available and -1 on end of
+ * file or error.
+ */
+static int
+capture_read(struct capture *cp)
+{
+	ssize_t n;
+	char *start, *end, *p;
+
+	n = read(cp->fd, cp->buf + cp->len, sizeof(cp->buf) - cp->len);
+	if (n == -1) {
+		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		diag(LOG_ERR, _("error reading output of %s: %s"),
+		     cp->handler->command, strerror(errno));
+		return -1;
+	}
+	if (n == 0)
 		return -1;
 
-	default:
-		debug(3, (_("logger for %s started, pid=%lu"),
-			  tag, (unsigned long) pid));
-		close(p[0]);
-		*return_proc = register_process(PROC_LOGGER, pid, 
-						time(NULL), 0);
-		return p[1];
+	start = cp->buf;
+	end = cp->buf + cp->len + n;
+	while ((p = memchr(start, '\n', end - start)) != NULL) {
+		capture_log(cp, start, p - start);
+		start = p + 1;
 	}
+	cp->len = end - start;
+	if (cp->len == sizeof(cp->buf)) {
+		capture_log(cp, cp->buf, cp->len);
+		cp->len = 0;
+	} else if (start > cp->buf)
+		memmove(cp->buf, start, cp->len);
+	return 1;
 }
-
+
+/*
+ * Wait for input on FD or on any of the capture pipes, at most TIMEOUT
+ * milliseconds (-1 means indefinitely).  FD may be -1.  Output that
+ * became available is read and logged.
+ *
+ * Return 1 if FD is ready for reading, 0 if it is not, and -1 on error
+ * (errno set).  If no captures are active and TIMEOUT is -1, return 1
+ * right away, so that the caller can block on FD itself.
+ */
+int
+capture_poll(int fd, int timeout)
+{
+	static struct pollfd *pfd;
+	static size_t pfd_max;
+	struct capture *cp, **pp;
+	size_t i, n;
+	int rc;
+
+	if (capture_count == 0 && fd != -1 && timeout == -1)
+		return 1;
+
+	n = capture_count + 1;
+	if (n > pfd_max) {
+		pfd = erealloc(pfd, n * sizeof(pfd[0]));
+		pfd_max = n;
+	}
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	for (i = 1, cp = capture_list; cp; cp = cp->next, i++) {
+		pfd[i].fd = cp->fd;
+		pfd[i].events = POLLIN;
+	}
+
+	rc = poll(pfd, n, timeout);
+	if (rc <= 0)
+		return rc;
+
+	for (i = 1, pp = &capture_list; *pp; i++) {
+		if (pfd[i].revents && capture_read(*pp) == -1)
+			capture_close(pp);
+		else
+			pp = &(*pp)->next;
+	}
+	return pfd[0].revents ? 1 : 0;
+}
+
+/*
+ * Close captures whose deadline has passed.  Return the number of
+ * seconds until the next deadline, or 0 if there are no captures.
+ */
+static time_t
+capture_timeouts(time_t now)
+{
+	struct capture **pp;
+	time_t alarm_time = 0;
+
+	for (pp = &capture_list; *pp; ) {
+		struct capture *cp = *pp;
+		if (now >= cp->deadline) {
+			while (capture_read(cp) == 1)
+				;
+			capture_close(pp);
+		} else {
+			if (alarm_time == 0 || cp->deadline - now < alarm_time)
+				alarm_time = cp->deadline - now;
+			pp = &cp->next;
+		}
+	}
+	return alarm_time;
+}
+
+/* Log whatever output is available and close all captures. */
+void
+capture_close_all(void)
+{
+	while (capture_list) {
+		while (capture_read(capture_list) == 1)
+			;
+		capture_close(&capture_list);
+	}
+}
+
 extern char **environ;    /* Environment */
 
 enum {
@@ -370,6 +586,8 @@ enum {
 	ENV_GENEV_CODE,
 	ENV_GENEV_NAME,
 	ENV_SELF_TEST_PID,
+	ENV_OLDFILE,
+	ENV_DIGEST,
 	DEFENV_COUNT
 };
 
@@ -384,6 +602,8 @@ static struct defenv {
 	[ENV_GENEV_CODE] = { "genev_code", "DIREVENT_GENEV_CODE" },
 	[ENV_GENEV_NAME] = { "genev_name", "DIREVENT_GENEV_NAME" },
 	[ENV_SELF_TEST_PID] = { "self_test_pid", "DIREVENT_SELF_TEST_PID" },
+	[ENV_OLDFILE]    = { "oldfile", "DIREVENT_OLDFILE" },
+	[ENV_DIGEST]     = { "digest", "DIREVENT_DIGEST" },
 };
 
 int
@@ -531,7 +751,8 @@ runcmd_getmacro(char **ret, const char *var, size_t len, void *clos)
 static void
 runcmd(struct prog_handler *hp, event_mask *event, const char *file)
 {
-	char buf[1024];
+	char sys_code[24], gen_code[24], pid_buf[24];
+	char const *gen_name, *sys_name;
 	char **argv;
 	environ_t *env;
 	char *xargv[4];
@@ -545,21 +766,23 @@ runcmd(struct prog_handler *hp, event_mask *event, const char *file)
 	
 	defenv[ENV_FILE].value = (char*) file;
 	
-	snprintf(buf, sizeof buf, "%d", event->sys_mask);
-	defenv[ENV_SYSEV_CODE].value = estrdup(buf);
+	snprintf(sys_code, sizeof sys_code, "%d", event->sys_mask);
+	defenv[ENV_SYSEV_CODE].value = sys_code;
 
-	snprintf(buf, sizeof buf, "%d", event->gen_mask);
-	defenv[ENV_GENEV_CODE].value = estrdup(buf);
+	snprintf(gen_code, sizeof gen_code, "%d", event->gen_mask);
+	defenv[ENV_GENEV_CODE].value = gen_code;
 
-	if (ev_format(*event,
-		      &defenv[ENV_GENEV_NAME].value,
-		      &defenv[ENV_SYSEV_NAME].value))
-		nomem_abend();
+	ev_format(*event, &gen_name, &sys_name);
+	defenv[ENV_GENEV_NAME].value = (char*) gen_name;
+	defenv[ENV_SYSEV_NAME].value = (char*) sys_name;
 
 	if (self_test_pid) {
-		snprintf(buf, sizeof buf, "%lu", (unsigned long)self_test_pid);
-		defenv[ENV_SELF_TEST_PID].value = estrdup(buf);
+		snprintf(pid_buf, sizeof pid_buf, "%lu",
+			 (unsigned long)self_test_pid);
+		defenv[ENV_SELF_TEST_PID].value = pid_buf;
 	}
+	defenv[ENV_OLDFILE].value = (char*) event_oldfile;
+	defenv[ENV_DIGEST].value = (char*) event_digest;
 
 	/*
 	 * Initialize the environment.
@@ -625,44 +848,48 @@ runcmd(struct prog_handler *hp, event_mask *event, const char *file)
 	_exit(127);
 }
 
+/*
+ * Start the handler HP for the given event.  JID and JREC supply the
+ * journal record of this run, REPLAYED is true if the run is replayed
+ * from the journal.  On success, the created process takes ownership
+ * of JREC.
+ */
 static int
-prog_handler_run(struct watchpoint *wp, event_mask *event,
-		 const char *dirname, const char *file, void *data, int notify)
+prog_handler_exec(struct prog_handler *hp, event_mask *event,
+		  const char *dirname, const char *file,
+		  unsigned long jid, char *jrec, int replayed)
 {
 	pid_t pid;
-	int logger_fd[2] = { -1, -1 };
-	struct process *logger_proc[2] = { NULL, NULL };
+	int capture_fd[2] = { -1, -1 };
+	char const *gen_name, *sys_name;
 	struct process *p;
-	struct prog_handler *hp = data;
+	struct timespec ts_fork;
 
-	if (!hp->command || !notify)
-		return 0;
-	
 	debug(1, (_("starting %s, dir=%s, file=%s"),
 		  hp->command, dirname, file));
 	if (hp->flags & HF_STDERR)
-		logger_fd[LOGGER_ERR] = open_logger(hp->command, LOG_ERR,
-						    &logger_proc[LOGGER_ERR]);
+		capture_fd[CAPTURE_ERR] = capture_open(hp, LOG_ERR);
 	if (hp->flags & HF_STDOUT)
-		logger_fd[LOGGER_OUT] = open_logger(hp->command, LOG_INFO,
-						    &logger_proc[LOGGER_OUT]);
+		capture_fd[CAPTURE_OUT] = capture_open(hp, LOG_INFO);
 	
+	/* Build the event name lists before forking, so that they are
+	   kept for subsequent runs */
+	ev_format(*event, &gen_name, &sys_name);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts_fork);
 	pid = fork();
 	if (pid == -1) {
 		diag(LOG_ERR, "fork: %s", strerror(errno));
-		close(logger_fd[LOGGER_OUT]);
-		close(logger_fd[LOGGER_ERR]);
-		if (logger_proc[LOGGER_OUT])
-			kill(logger_proc[LOGGER_OUT]->pid, SIGKILL);
-		if (logger_proc[LOGGER_ERR])
-			kill(logger_proc[LOGGER_ERR]->pid, SIGKILL);
+		close(capture_fd[CAPTURE_OUT]);
+		close(capture_fd[CAPTURE_ERR]);
 		return -1;
 	}
 	
 	if (pid == 0) {		
 		/* child */
 		int keepfd[3] = { 0, 0, 0 };
-		
+
+		diag_fork_child();
 		if (switchpriv(hp))
 			_exit(127);
 		
@@ -672,17 +899,17 @@ prog_handler_run(struct watchpoint *wp, event_mask *event,
 			_exit(127);
 		}
 
-		if (logger_fd[LOGGER_OUT] != -1) {
-			if (logger_fd[LOGGER_OUT] != 1 &&
-			    dup2(logger_fd[LOGGER_OUT], 1) == -1) {
+		if (capture_fd[CAPTURE_OUT] != -1) {
+			if (capture_fd[CAPTURE_OUT] != 1 &&
+			    dup2(capture_fd[CAPTURE_OUT], 1) == -1) {
 				diag(LOG_ERR, "dup2: %s", strerror(errno));
 				_exit(127);
 			}
 			keepfd[1] = 1;
 		}
-		if (logger_fd[LOGGER_ERR] != -1) {
-			if (logger_fd[LOGGER_ERR] != 2 &&
-			    dup2(logger_fd[LOGGER_ERR], 2) == -1) {
+		if (capture_fd[CAPTURE_ERR] != -1) {
+			if (capture_fd[CAPTURE_ERR] != 2 &&
+			    dup2(capture_fd[CAPTURE_ERR], 2) == -1) {
 				diag(LOG_ERR, "dup2: %s", strerror(errno));
 				_exit(127);
 			}
@@ -704,19 +931,18 @@ prog_handler_run(struct watchpoint *wp, event_mask *event,
 		  hp->command, dirname, file, (unsigned long)pid));
 
 	p = register_process(PROC_HANDLER, pid, time(NULL), hp->timeout);
-
-	if (logger_proc[LOGGER_OUT]) {
-		logger_proc[LOGGER_OUT]->v.master = p;
-		logger_proc[LOGGER_OUT]->timeout = hp->timeout;
-	}
-	if (logger_proc[LOGGER_ERR]) {
-		logger_proc[LOGGER_ERR]->v.master = p;
-		logger_proc[LOGGER_ERR]->timeout = hp->timeout;
-	}
-	memcpy(p->v.logger, logger_proc, sizeof(p->v.logger));
-	
-	close(logger_fd[LOGGER_OUT]);
-	close(logger_fd[LOGGER_ERR]);
+	p->handler = hp;
+	hp->refcnt++;
+	hp->running++;
+	if (!replayed)
+		p->ts_event = event_read_time;
+	p->ts_fork = ts_fork;
+	p->jid = jid;
+	p->jrec = jrec;
+	p->replayed = replayed;
+
+	close(capture_fd[CAPTURE_OUT]);
+	close(capture_fd[CAPTURE_ERR]);
 
 	if (hp->flags & HF_NOWAIT) {
 		return 0;
@@ -725,7 +951,8 @@ prog_handler_run(struct watchpoint *wp, event_mask *event,
 	debug(2, (_("waiting for %s (%lu) to terminate"),
 		  hp->command, (unsigned long)pid));
 	while (time(NULL) - p->start < 2 * p->timeout) {
-		sleep(1);
+		if (capture_poll(-1, 1000) == -1 && errno != EINTR)
+			sleep(1);
 		process_cleanup(1);
 		if (p->pid == 0)
 			break;
@@ -733,18 +960,112 @@ prog_handler_run(struct watchpoint *wp, event_mask *event,
 	return 0;
 }
 
+/*
+ * Return 1 if the event on FILE is likely caused by the handler HP
+ * itself, i.e. if FILE matches its output patterns and the handler is
+ * running or has exited less than output_grace seconds ago.
+ */
+static int
+prog_handler_own_output(struct prog_handler *hp, const char *file)
+{
+	if (filpatlist_is_empty(hp->onames)
+	    || filpatlist_match(hp->onames, file))
+		return 0;
+	return hp->running > 0 || time(NULL) < hp->quiet_until;
+}
+
+static int
+prog_handler_run(struct watchpoint *wp, event_mask *event,
+		 const char *dirname, const char *file, void *data, int notify)
+{
+	struct prog_handler *hp = data;
+	unsigned long jid;
+	char *jrec;
+
+	if (!hp->command || !notify)
+		return 0;
+	if (prog_handler_own_output(hp, file)) {
+		debug(1, (_("%s: ignoring %s/%s: handler output"),
+			  hp->command, dirname, file));
+		hp->suppressed++;
+		return 0;
+	}
+	jid = journal_start(event, dirname, file, hp->command, &jrec);
+	if (prog_handler_exec(hp, event, dirname, file, jid, jrec, 0)) {
+		journal_fail(jid, jrec);
+		return -1;
+	}
+	return 0;
+}
+
 void
 prog_handler_free(struct prog_handler *hp)
 {
 	free(hp->command);
+	free(hp->name);
 	free(hp->gidv);
 	envop_free(hp->envop);
+	filpatlist_destroy(&hp->onames);
+}
+
+/* List of allocated handlers */
+static struct prog_handler *prog_handler_head;
+
+static void
+prog_handler_unref(struct prog_handler *hp)
+{
+	if (--hp->refcnt)
+		return;
+	if (hp->prev)
+		hp->prev->next = hp->next;
+	else
+		prog_handler_head = hp->next;
+	if (hp->next)
+		hp->next->prev = hp->prev;
+	prog_handler_free(hp);
+	free(hp);
 }
 
 static void
 prog_handler_free_data(void *ptr)
 {
-	prog_handler_free((struct prog_handler *)ptr);
+	prog_handler_unref((struct prog_handler *)ptr);
+}
+
+void
+prog_handler_stats(void)
+{
+	struct prog_handler *hp;
+
+	for (hp = prog_handler_head; hp; hp = hp->next) {
+		char const *name = hp->name ? hp->name : hp->command;
+
+		latency_hist_log(&hp->lat_dispatch, name, "dispatch");
+		latency_hist_log(&hp->lat_run, name, "run");
+		if (!filpatlist_is_empty(hp->onames))
+			diag(LOG_INFO, _("%s: %lu events on output files "
+					 "suppressed"),
+			     hp->command, hp->suppressed);
+	}
+}
+
+/*
+ * Restart the handler run restored from the journal.  The run is
+ * attributed to the first handler with the same COMMAND.
+ */
+int
+prog_handler_replay(char const *command, event_mask *event,
+		    char const *dirname, char const *file,
+		    unsigned long jid, char *jrec)
+{
+	struct prog_handler *hp;
+
+	for (hp = prog_handler_head; hp; hp = hp->next)
+		if (hp->command && strcmp(hp->command, command) == 0)
+			return prog_handler_exec(hp, event, dirname, file,
+						 jid, jrec, 1);
+	diag(LOG_NOTICE, _("not replaying %s: no such handler"), command);
+	return -1;
 }
 
 struct handler *
@@ -760,6 +1081,12 @@ prog_handler_alloc(event_mask ev_mask, filpatlist_t fpat,
 	hp->notify_always = 0;
 	mem = emalloc(sizeof(*mem));
 	*mem = *p;
+	mem->refcnt = 1;
+	mem->prev = NULL;
+	mem->next = prog_handler_head;
+	if (prog_handler_head)
+		prog_handler_head->prev = mem;
+	prog_handler_head = mem;
 	hp->data = mem;
 	memset(p, 0, sizeof(*p));
 	return hp;
@@ -0,0 +1,446 @@
+/* direvent - directory content watcher daemon
+   Copyright (C) 2012-2021 Sergey Poznyakoff
+
+   GNU direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   GNU direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "direvent.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/*
+ * Tree snapshot.
+ *
+ * On shutdown, the state of each entry in the watched directories is
+ * saved to the snapshot file.  On startup, the initial crawl compares
+ * the directory contents with the snapshot, and the differences are
+ * delivered to the handlers as synthetic CREATE, WRITE (and CHANGE) and
+ * DELETE events, so that the changes made while the daemon was not
+ * running are not lost.
+ *
+ * The file consists of a header followed by a sequence of records.  The
+ * records are stored in host byte order and aligned on 8-byte boundary,
+ * so that the file can be used directly after being mapped into memory.
+ */
+
+char *snapshot_file;
+
+#define SNAPSHOT_MAGIC "DIREVSNP"
+#define SNAPSHOT_VERSION 1
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;           /* Number of records */
+};
+
+struct snapshot_record {
+	uint64_t ino;
+	int64_t mtime;
+	int64_t ctime;
+	uint64_t size;
+	uint32_t mode;
+	uint32_t namelen;         /* Length of name, without terminating 0 */
+	char name[1];             /* Full pathname of the entry */
+};
+
+#define SNAPSHOT_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define SNAPSHOT_RECLEN(namelen) \
+	SNAPSHOT_ALIGN(offsetof(struct snapshot_record, name) + (namelen) + 1)
+
+struct snapent {
+	char *name;               /* Pathname (symtab key) */
+	struct snapshot_record const *rec;
+	int seen;                 /* Entry was found by the crawler */
+};
+
+/* Snapshot loaded at startup */
+static void *snapshot_map;
+static size_t snapshot_map_size;
+static struct grecs_symtab *snapshot_tab;
+/* Directories compared with the snapshot */
+static struct grecs_symtab *snapshot_dirs;
+
+/* Synthetic events waiting for delivery */
+struct snapev {
+	struct watchpoint *wp;
+	int gen_mask;
+	char *name;
+};
+static grecs_list_ptr_t snapshot_events;
+
+void
+snapshot_load(void)
+{
+	int fd;
+	struct stat st;
+	struct snapshot_header const *hdr;
+	char const *p, *end;
+	uint32_t i;
+
+	if (!snapshot_file)
+		return;
+	fd = open(snapshot_file, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			diag(LOG_ERR, _("cannot open snapshot %s: %s"),
+			     snapshot_file, strerror(errno));
+		return;
+	}
+	if (fstat(fd, &st)) {
+		diag(LOG_ERR, _("cannot stat snapshot %s: %s"),
+		     snapshot_file, strerror(errno));
+		close(fd);
+		return;
+	}
+	if (st.st_size < sizeof(*hdr)) {
+		diag(LOG_ERR, _("%s: snapshot file too short"),
+		     snapshot_file);
+		close(fd);
+		return;
+	}
+	snapshot_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (snapshot_map == MAP_FAILED) {
+		diag(LOG_ERR, _("cannot map snapshot %s: %s"),
+		     snapshot_file, strerror(errno));
+		snapshot_map = NULL;
+		return;
+	}
+	snapshot_map_size = st.st_size;
+
+	hdr = snapshot_map;
+	if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic))
+	    || hdr->version != SNAPSHOT_VERSION) {
+		diag(LOG_ERR, _("%s: not a snapshot file or wrong version"),
+		     snapshot_file);
+		snapshot_free();
+		return;
+	}
+
+	snapshot_tab = grecs_symtab_create_default(sizeof(struct snapent));
+	snapshot_dirs = grecs_symtab_create_default(sizeof(struct grecs_syment));
+	if (!snapshot_tab || !snapshot_dirs)
+		nomem_abend();
+	p = (char const *) (hdr + 1);
+	end = (char const *) snapshot_map + snapshot_map_size;
+	for (i = 0; i < hdr->count; i++) {
+		struct snapshot_record const *rec = (void const *) p;
+		struct snapent key, *ent;
+		int install = 1;
+
+		if (end - p < offsetof(struct snapshot_record, name)
+		    || end - p < SNAPSHOT_RECLEN(rec->namelen)
+		    || rec->name[rec->namelen]) {
+			diag(LOG_ERR, _("%s: snapshot file truncated"),
+			     snapshot_file);
+			break;
+		}
+		key.name = (char *) rec->name;
+		ent = grecs_symtab_lookup_or_install(snapshot_tab, &key,
+						     &install);
+		if (!ent)
+			nomem_abend();
+		ent->rec = rec;
+		ent->seen = 0;
+		p += SNAPSHOT_RECLEN(rec->namelen);
+	}
+	debug(1, (_("loaded %lu entries from snapshot %s"),
+		  (unsigned long) grecs_symtab_count(snapshot_tab),
+		  snapshot_file));
+}
+
+void
+snapshot_free(void)
+{
+	grecs_symtab_free(snapshot_tab);
+	snapshot_tab = NULL;
+	grecs_symtab_free(snapshot_dirs);
+	snapshot_dirs = NULL;
+	if (snapshot_map) {
+		munmap(snapshot_map, snapshot_map_size);
+		snapshot_map = NULL;
+	}
+}
+
+static void
+snapev_free(void *ptr)
+{
+	struct snapev *ev = ptr;
+	watchpoint_unref(ev->wp);
+	free(ev->name);
+	free(ev);
+}
+
+static void
+snapshot_queue(struct watchpoint *wp, int gen_mask, char const *name)
+{
+	struct snapev *ev = emalloc(sizeof(*ev));
+
+	ev->wp = wp;
+	watchpoint_ref(wp);
+	ev->gen_mask = gen_mask;
+	ev->name = estrdup(name);
+	if (!snapshot_events) {
+		snapshot_events = grecs_list_create();
+		snapshot_events->free_entry = snapev_free;
+	}
+	grecs_list_append(snapshot_events, ev);
+}
+
+/* Return true if a snapshot was loaded and the crawl is checked
+   against it. */
+int
+snapshot_loaded(void)
+{
+	return snapshot_tab != NULL;
+}
+
+/* Note that the directory of the watchpoint WP is being crawled. */
+void
+snapshot_scan_dir(struct watchpoint *wp)
+{
+	struct grecs_syment key;
+	int install = 1;
+
+	if (!snapshot_tab)
+		return;
+	key.name = wp->dirname;
+	if (!grecs_symtab_lookup_or_install(snapshot_dirs, &key, &install))
+		nomem_abend();
+}
+
+/*
+ * Compare the entry NAME found in the directory of WP with the snapshot.
+ * PATHNAME is its full pathname, ST is its stat buffer or NULL, if
+ * the entry is known to exist but was not stat'ed.
+ */
+void
+snapshot_check(struct watchpoint *wp, char const *pathname,
+	       char const *name, struct stat const *st)
+{
+	struct snapent key, *ent;
+
+	if (!snapshot_tab)
+		return;
+	key.name = (char *) pathname;
+	ent = grecs_symtab_lookup_or_install(snapshot_tab, &key, NULL);
+	if (!ent) {
+		debug(1, (_("%s: created while not watched"), pathname));
+		snapshot_queue(wp, GENEV_CREATE, name);
+		return;
+	}
+	ent->seen = 1;
+	if (st && !S_ISDIR(st->st_mode)
+	    && (ent->rec->ino != st->st_ino
+		|| ent->rec->mtime != st->st_mtime
+		|| ent->rec->ctime != st->st_ctime
+		|| ent->rec->size != st->st_size)) {
+		debug(1, (_("%s: modified while not watched"), pathname));
+		snapshot_queue(wp, GENEV_WRITE|GENEV_CHANGE, name);
+	}
+}
+
+static int
+snapshot_check_deleted(void *sym, void *data)
+{
+	struct snapent *ent = sym;
+	struct grecs_syment key, *dir;
+	char *p;
+	struct watchpoint *wp;
+
+	if (ent->seen)
+		return 0;
+	p = strrchr(ent->name, '/');
+	if (!p)
+		return 0;
+	*p = 0;
+	key.name = ent->name;
+	dir = grecs_symtab_lookup_or_install(snapshot_dirs, &key, NULL);
+	wp = dir ? watchpoint_lookup(ent->name) : NULL;
+	*p = '/';
+	if (wp) {
+		debug(1, (_("%s: deleted while not watched"), ent->name));
+		snapshot_queue(wp, GENEV_DELETE, p + 1);
+	}
+	return 0;
+}
+
+/*
+ * Finish comparison: queue DELETE events for the entries that were
+ * present in the snapshot but disappeared from the crawled directories.
+ * Entries of the directories that were not crawled (e.g. removed
+ * directories, whose removal is reported in their parent) are ignored.
+ */
+void
+snapshot_scan_done(void)
+{
+	if (!snapshot_tab)
+		return;
+	grecs_symtab_foreach(snapshot_tab, snapshot_check_deleted, NULL);
+	snapshot_free();
+}
+
+/* Deliver the queued synthetic events. */
+void
+snapshot_replay(void)
+{
+	struct grecs_list_entry *ep;
+
+	if (!snapshot_events)
+		return;
+	for (ep = snapshot_events->head; ep; ep = ep->next) {
+		struct snapev *ev = ep->data;
+		event_mask event = { ev->gen_mask, 0 };
+		handler_iterator_t itr;
+		struct handler *hp;
+		event_mask m;
+		struct evstat es = EVSTAT_INIT(ev->wp->dirname, ev->name);
+
+		for_each_handler(ev->wp, itr, hp) {
+			/* Skip sentinels: the watchers are already set up */
+			if (hp->notify_always)
+				continue;
+			if (evtand(&event, &hp->ev_mask, &m) &&
+			    handler_file_match(hp, ev->name) == 0 &&
+			    handler_attr_match(hp, &es) == 0)
+				handler_dispatch(ev->wp, hp, &m,
+						 ev->wp->dirname, ev->name,
+						 &es);
+		}
+	}
+	grecs_list_free(snapshot_events);
+	snapshot_events = NULL;
+}
+
+/* Saving the snapshot */
+
+struct snapshot_writer {
+	FILE *fp;
+	uint32_t count;
+	int err;
+};
+
+static void
+snapshot_write_entry(struct snapshot_writer *wr, char const *pathname,
+		     struct stat const *st)
+{
+	size_t namelen = strlen(pathname);
+	size_t reclen = SNAPSHOT_RECLEN(namelen);
+	struct snapshot_record *rec = ecalloc(1, reclen);
+
+	rec->ino = st->st_ino;
+	rec->mtime = st->st_mtime;
+	rec->ctime = st->st_ctime;
+	rec->size = st->st_size;
+	rec->mode = st->st_mode;
+	rec->namelen = namelen;
+	memcpy(rec->name, pathname, namelen + 1);
+	if (fwrite(rec, reclen, 1, wr->fp) != 1)
+		wr->err = errno;
+	else
+		wr->count++;
+	free(rec);
+}
+
+static int
+snapshot_write_dir(struct watchpoint *wpt, void *data)
+{
+	struct snapshot_writer *wr = data;
+	DIR *dir;
+	struct dirent *ent;
+
+	if (wr->err || !watchpoint_watched(wpt) || !wpt->isdir)
+		return 0;
+
+	dir = opendir(wpt->dirname);
+	if (!dir) {
+		diag(LOG_ERR, _("cannot open directory %s: %s"),
+		     wpt->dirname, strerror(errno));
+		return 0;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		char *pathname;
+		struct stat st;
+
+		if (ent->d_name[0] == '.' &&
+		    (ent->d_name[1] == 0 ||
+		     (ent->d_name[1] == '.' && ent->d_name[2] == 0)))
+			continue;
+		if (dirent_stat(dir, wpt->dirname, ent->d_name, &st, 1))
+			continue;
+		pathname = mkfilename(wpt->dirname, ent->d_name);
+		if (!pathname)
+			nomem_abend();
+		snapshot_write_entry(wr, pathname, &st);
+		free(pathname);
+	}
+	closedir(dir);
+	return wr->err;
+}
+
+void
+snapshot_save(void)
+{
+	struct snapshot_writer wr;
+	struct snapshot_header hdr;
+	char *tmpname;
+
+	if (!snapshot_file)
+		return;
+	tmpname = emalloc(strlen(snapshot_file) + 5);
+	strcat(strcpy(tmpname, snapshot_file), ".tmp");
+	wr.fp = fopen(tmpname, "w");
+	if (!wr.fp) {
+		diag(LOG_ERR, _("cannot create %s: %s"),
+		     tmpname, strerror(errno));
+		free(tmpname);
+		return;
+	}
+	wr.count = 0;
+	wr.err = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAPSHOT_VERSION;
+	if (fwrite(&hdr, sizeof(hdr), 1, wr.fp) != 1)
+		wr.err = errno;
+	else
+		watchpoint_foreach(snapshot_write_dir, &wr);
+
+	/* Update record count */
+	hdr.count = wr.count;
+	if (!wr.err
+	    && (fseek(wr.fp, 0, SEEK_SET)
+		|| fwrite(&hdr, sizeof(hdr), 1, wr.fp) != 1))
+		wr.err = errno;
+	if (fclose(wr.fp) && !wr.err)
+		wr.err = errno;
+
+	if (wr.err) {
+		diag(LOG_ERR, _("error writing %s: %s"),
+		     tmpname, strerror(wr.err));
+		unlink(tmpname);
+	} else if (rename(tmpname, snapshot_file)) {
+		diag(LOG_ERR, _("cannot rename %s to %s: %s"),
+		     tmpname, snapshot_file, strerror(errno));
+		unlink(tmpname);
+	} else
+		debug(1, (_("saved %lu entries to snapshot %s"),
+			  (unsigned long) wr.count, snapshot_file));
+	free(tmpname);
+}
@@ -0,0 +1,217 @@
+/* direvent - directory content watcher daemon
+   Copyright (C) 2012-2021 Sergey Poznyakoff
+
+   GNU direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   GNU direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "direvent.h"
+
+/* Run-time statistics */
+
+/* Set by the SIGUSR2 handler to request statistics dump */
+int stats_requested;
+/* Time when the kernel events being processed were read */
+struct timespec event_read_time;
+/* Total number of kernel events read so far */
+unsigned long stat_events;
+
+/* Name of the latency trace file, if configured. */
+char *trace_file;
+static FILE *trace_fp;
+static struct timespec start_time;
+
+void
+stats_init(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+}
+
+void
+stats_event_read(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &event_read_time);
+}
+
+/*
+ * Mark the end of processing of the kernel events.  Handlers started
+ * afterwards, e.g. by deferred scans, have no triggering event.
+ */
+void
+stats_event_done(void)
+{
+	event_read_time.tv_sec = 0;
+	event_read_time.tv_nsec = 0;
+}
+
+/* Return the difference a - b in microseconds. */
+unsigned long long
+timespec_diff_usec(struct timespec const *a, struct timespec const *b)
+{
+	long long d = (long long) (a->tv_sec - b->tv_sec) * 1000000
+		      + (a->tv_nsec - b->tv_nsec) / 1000;
+	return d < 0 ? 0 : d;
+}
+
+/* Microseconds since startup. */
+static unsigned long long
+timespec_usec(struct timespec const *ts)
+{
+	return timespec_diff_usec(ts, &start_time);
+}
+
+/*
+ * Latency histograms.  Bucket I counts the samples that took less than
+ * 2^I microseconds.  The last bucket accumulates everything that took
+ * longer.
+ */
+void
+latency_hist_add(struct latency_hist *hist, unsigned long long usec)
+{
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++)
+		if (usec < (1ULL << i))
+			break;
+	hist->bucket[i]++;
+	hist->count++;
+	hist->total += usec;
+	if (usec > hist->max)
+		hist->max = usec;
+}
+
+/*
+ * Return upper bound (in microseconds) of the bucket where the PCT
+ * percentile of samples is located.
+ */
+static unsigned long long
+latency_hist_percentile(struct latency_hist *hist, unsigned pct)
+{
+	unsigned long n = 0;
+	unsigned long limit = (hist->count * pct + 99) / 100;
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		n += hist->bucket[i];
+		if (n >= limit)
+			return 1ULL << i;
+	}
+	return hist->max;
+}
+
+void
+latency_hist_log(struct latency_hist *hist, char const *name,
+		 char const *stage)
+{
+	if (hist->count == 0)
+		return;
+	diag(LOG_INFO,
+	     _("%s: %s latency: count=%lu, avg=%lluus, p50<%lluus, "
+	       "p99<%lluus, max=%lluus"),
+	     name, stage, hist->count,
+	     hist->total / hist->count,
+	     latency_hist_percentile(hist, 50),
+	     latency_hist_percentile(hist, 99),
+	     hist->max);
+}
+
+/*
+ * Latency trace file.  Completed handler runs are written to it in
+ * Chrome trace event format, which can be loaded to chrome://tracing or
+ * ui.perfetto.dev.  The closing bracket of the event array is optional in
+ * that format, which allows to append records as they arrive.
+ */
+void
+trace_open(void)
+{
+	if (!trace_file)
+		return;
+	trace_fp = fopen(trace_file, "w");
+	if (!trace_fp) {
+		diag(LOG_ERR, _("cannot open trace file %s: %s"),
+		     trace_file, strerror(errno));
+		return;
+	}
+	fprintf(trace_fp, "[\n");
+	fflush(trace_fp);
+}
+
+void
+trace_close(void)
+{
+	if (trace_fp) {
+		fclose(trace_fp);
+		trace_fp = NULL;
+	}
+}
+
+static void
+trace_json_string(char const *str)
+{
+	fputc('"', trace_fp);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fputc('\\', trace_fp);
+		if ((unsigned char)*str < ' ')
+			fprintf(trace_fp, "\\u%04x", *str);
+		else
+			fputc(*str, trace_fp);
+	}
+	fputc('"', trace_fp);
+}
+
+/*
+ * Record the timeline of a single handler run: the event was read at
+ * TS_EVENT, the handler forked at TS_FORK and exited at TS_EXIT.
+ * TS_EVENT is NULL if the run was not triggered by a kernel event.
+ */
+void
+trace_handler(char const *command, pid_t pid, struct timespec const *ts_event,
+	      struct timespec const *ts_fork, struct timespec const *ts_exit)
+{
+	if (!trace_fp)
+		return;
+	if (ts_event)
+		fprintf(trace_fp,
+			"{\"name\":\"dispatch\",\"cat\":\"direvent\","
+			"\"ph\":\"X\",\"pid\":%lu,\"tid\":%lu,"
+			"\"ts\":%llu,\"dur\":%llu},\n",
+			(unsigned long) getpid(), (unsigned long) pid,
+			timespec_usec(ts_event),
+			timespec_diff_usec(ts_fork, ts_event));
+	fprintf(trace_fp, "{\"name\":");
+	trace_json_string(command);
+	fprintf(trace_fp, ",\"cat\":\"handler\",\"ph\":\"X\","
+		"\"pid\":%lu,\"tid\":%lu,\"ts\":%llu,\"dur\":%llu},\n",
+		(unsigned long) getpid(), (unsigned long) pid,
+		timespec_usec(ts_fork),
+		timespec_diff_usec(ts_exit, ts_fork));
+	fflush(trace_fp);
+}
+
+void
+stats_dump(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	diag(LOG_INFO, _("statistics: uptime %llus, %lu events read"),
+	     timespec_diff_usec(&now, &start_time) / 1000000,
+	     stat_events);
+	sysev_stats();
+	watchpoint_recent_stats();
+	poll_stats();
+	scan_stats();
+	digest_stats();
+	prog_handler_stats();
+	diag_stats();
+}
@@ -17,7 +17,7 @@
 #include "direvent.h"
 #include <dirent.h>
 #include <sys/stat.h>
-#include <sys/time.h>
+#include <fnmatch.h>
 
 void
 watchpoint_ref(struct watchpoint *wpt)
@@ -30,12 +30,10 @@ watchpoint_unref(struct watchpoint *wpt)
 {
 	if (--wpt->refcnt)
 		return;
-#if USE_IFACE == IFACE_INOTIFY
-	grecs_symtab_free(wpt->files_changed);
-#endif
 	watchpoint_recent_deinit(wpt);
 	free(wpt->dirname);
 	handler_list_unref(wpt->handler_list);
+	handler_list_unref(wpt->sentinel_list);
 	free(wpt);
 }
 
@@ -90,95 +88,211 @@ wpref_free(void *p)
 	free(wpref);
 }
 
-struct watchpoint *recent_head, *recent_tail;
+/*
+ * Recently created directories.
+ *
+ * When a new subdirectory is watched, its contents are reported by
+ * the crawl in watch_subdirs, while the kernel may also report some of
+ * the same files.  To avoid delivering CREATE twice, the names reported
+ * in a recently added directory are remembered for recent_ttl seconds.
+ *
+ * Names of all watchpoints are kept in two generations of a single
+ * table, keyed by the watchpoint serial number and the name.  New
+ * entries go into the current generation.  Every recent_ttl seconds the
+ * previous generation is dropped as a whole, and the current one takes
+ * its place.  A watchpoint is recent during the generation in which it
+ * was created and the one that follows.
+ */
+unsigned recent_ttl = WATCHPOINT_RECENT_TTL;
+
+struct recent_ent {
+	unsigned long serial;   /* Watchpoint serial number */
+	char *name;             /* File name */
+};
+
+static struct grecs_symtab *recent_tab[2]; /* Current and previous
+					      generations */
+static unsigned long recent_gen = 1;       /* Current generation number */
+static time_t recent_start;                /* Start of the current
+					      generation */
+static int recent_deferred;                /* Rotation was deferred */
+static unsigned long watchpoint_serial;
+
+static unsigned
+recent_ent_hash(void *data, unsigned long hashsize)
+{
+	struct recent_ent *ent = data;
+	return (grecs_hash_string(ent->name, hashsize) + ent->serial)
+		% hashsize;
+}
+
+static int
+recent_ent_cmp(const void *a, const void *b)
+{
+	struct recent_ent const *enta = a;
+	struct recent_ent const *entb = b;
+
+	if (enta->serial != entb->serial)
+		return 1;
+	return strcmp(enta->name, entb->name);
+}
+
+static int
+recent_ent_copy(void *a, void *b)
+{
+	struct recent_ent *enta = a;
+	struct recent_ent *entb = b;
+
+	enta->serial = entb->serial;
+	enta->name = strdup(entb->name);
+	return enta->name == NULL;
+}
 
 static void
-watchpoint_recent_link(struct watchpoint *wp)
+recent_ent_free(void *p)
 {
-	wp->rhead.next = NULL;
-	wp->rhead.prev = recent_tail;
-	if (recent_tail)
-		recent_tail->rhead.next = wp;
-	else
-		recent_head = wp;
-	recent_head = wp;
+	struct recent_ent *ent = p;
+	free(ent->name);
+	free(ent);
+}
+
+static struct grecs_symtab *
+recent_tab_create(void)
+{
+	struct grecs_symtab *tab;
+
+	tab = grecs_symtab_create(sizeof(struct recent_ent),
+				  recent_ent_hash, recent_ent_cmp,
+				  recent_ent_copy, NULL, recent_ent_free);
+	if (!tab)
+		nomem_abend();
+	return tab;
 }
 
+/* Start new generations, if recent_ttl seconds have passed. */
 static void
-watchpoint_recent_unlink(struct watchpoint *wp)
+recent_rotate(time_t now)
 {
-	struct watchpoint *p;
-	
-	if ((p = wp->rhead.prev) != NULL)
-		p->rhead.next = wp->rhead.next;
-	else
-		recent_head = wp->rhead.next;
-	if ((p = wp->rhead.next) != NULL)
-		p->rhead.prev = wp->rhead.prev;
-	else
-		recent_tail = wp->rhead.prev;
+	time_t n;
+	struct grecs_symtab *tab;
+
+	if (recent_ttl == 0 || now - recent_start < recent_ttl)
+		return;
+	if (scan_pending()) {
+		/* Names from the scans in progress are still needed */
+		recent_deferred = 1;
+		return;
+	}
+	n = (now - recent_start) / recent_ttl;
+	if (recent_start == 0)
+		n = 2;
+	else if (recent_deferred)
+		/* The names recorded by the scans are fresh: the kernel
+		   may still have CREATE events for them queued */
+		n = 1;
+	recent_deferred = 0;
+	if (n >= 2) {
+		if (recent_tab[0])
+			grecs_symtab_clear(recent_tab[0]);
+		if (recent_tab[1])
+			grecs_symtab_clear(recent_tab[1]);
+	} else if (recent_tab[1]) {
+		tab = recent_tab[1];
+		grecs_symtab_clear(tab);
+		recent_tab[1] = recent_tab[0];
+		recent_tab[0] = tab;
+	} else {
+		recent_tab[1] = recent_tab[0];
+		recent_tab[0] = NULL;
+	}
+	recent_gen += n;
+	recent_start = now;
+}
+
+static int
+watchpoint_is_recent(struct watchpoint *wp)
+{
+	return wp->recent_gen != 0 && recent_gen - wp->recent_gen <= 1;
 }
 
 void
 watchpoint_recent_deinit(struct watchpoint *wp)
 {
-	if (wp->rhead.names) {
+	if (wp->recent_gen) {
 		debug(1, (_("%s: recent status expired"), wp->dirname));
-		watchpoint_recent_unlink(wp);
-		grecs_symtab_free(wp->rhead.names);
-		wp->rhead.names = NULL;
+		wp->recent_gen = 0;
 	}
 }
 
 void
 watchpoint_recent_init(struct watchpoint *wp)
 {
-	gettimeofday(&wp->rhead.tv, NULL);
-	wp->rhead.names = grecs_symtab_create_default(sizeof(struct grecs_syment));
-	if (!wp->rhead.names) {
-		nomem_abend();
-	}
-	watchpoint_recent_link(wp);
-	alarm(1);
+	unsigned left;
+
+	if (recent_ttl == 0)
+		return;
+	recent_rotate(time(NULL));
+	wp->recent_gen = recent_gen;
+	/* Make sure the generations get rotated */
+	left = alarm(0);
+	alarm(left && left < recent_ttl ? left : recent_ttl);
 }
 
 int
 watchpoint_recent_lookup(struct watchpoint *wp, char const *name)
 {
+	struct recent_ent key;
 	int install = 1;
-	if (wp->rhead.names) {
-		struct grecs_syment key;
-		struct grecs_syment *ent;
-
-		key.name = (char*) name;
-		ent = grecs_symtab_lookup_or_install(wp->rhead.names, &key,
-						     &install);
-		if (!ent)
-			nomem_abend();
-	}
+
+	if (!wp->recent_gen)
+		return 0;
+	recent_rotate(time(NULL));
+	if (!watchpoint_is_recent(wp))
+		return 0;
+
+	key.serial = wp->serial;
+	key.name = (char*) name;
+	if (recent_tab[1] && grecs_symtab_lookup_or_install(recent_tab[1],
+							    &key, NULL))
+		return 1;
+	if (!recent_tab[0])
+		recent_tab[0] = recent_tab_create();
+	if (!grecs_symtab_lookup_or_install(recent_tab[0], &key, &install))
+		nomem_abend();
 	return !install;
 }
 
+/*
+ * Expire old generations.  Return the number of seconds until the next
+ * rotation, or 0 if nothing is being tracked.
+ */
 int
 watchpoint_recent_cleanup(void)
 {
-	struct timeval now;
-	struct watchpoint *wp;
-	int d = 0;
-	
-	gettimeofday(&now, NULL);
-	for (wp = recent_head; wp; ) {
-		struct watchpoint *next = wp->rhead.next;
-		d = now.tv_sec - wp->rhead.tv.tv_sec;
-		if (d > WATCHPOINT_RECENT_TTL)
-			watchpoint_recent_deinit(wp);
-		else
-			break;
-		wp = next;
+	time_t now = time(NULL);
+
+	recent_rotate(now);
+	if ((recent_tab[0] && grecs_symtab_count(recent_tab[0]))
+	    || (recent_tab[1] && grecs_symtab_count(recent_tab[1]))) {
+		time_t d = recent_start + recent_ttl - now;
+		return d > 0 ? d : 1;
 	}
-	return d;
+	return 0;
 }
-
+
+void
+watchpoint_recent_stats(void)
+{
+	size_t count = 0;
+
+	if (recent_tab[0])
+		count += grecs_symtab_count(recent_tab[0]);
+	if (recent_tab[1])
+		count += grecs_symtab_count(recent_tab[1]);
+	diag(LOG_INFO, _("recently created: %lu names tracked"),
+	     (unsigned long) count);
+}
+
 struct grecs_symtab *nametab;
 
 struct watchpoint *
@@ -208,6 +322,7 @@ watchpoint_install(const char *path, int *pnew)
 		wpt->wd = -1;
 		wpt->handler_list = handler_list_create();
 		wpt->refcnt = 0;
+		wpt->serial = ++watchpoint_serial;
 		ent->wpt = wpt;
 	}
 	if (!ent)
@@ -281,20 +396,31 @@ watchpoint_remove(const char *dirname)
 	grecs_symtab_remove(nametab, &key);
 }
 
+static void watchpoint_rm_watch(struct watchpoint *wpt);
+
 void
 watchpoint_destroy(struct watchpoint *wpt)
 {
 	debug(1, (_("removing watcher %s"), wpt->dirname));
-	watchpoint_recent_deinit(wpt);//FIXME: This should also reset the timer
-	sysev_rm_watch(wpt);
+	watchpoint_recent_deinit(wpt);
+	watchpoint_rm_watch(wpt);
 	watchpoint_remove(wpt->dirname);
 }
 
+static void spine_discard_descendants(struct watchpoint *wpt);
+static void sentinel_relocate(struct watchpoint *wpt);
+static size_t watchpoint_handler_count(struct watchpoint *wpt);
+
 void
 watchpoint_suspend(struct watchpoint *wpt)
 {
+	if (wpt->isspine)
+		spine_discard_descendants(wpt);
 	if (!wpt->parent) { /* A top-level watchpoint */
-		if (watchpoint_install_sentinel(wpt)) {
+		sentinel_relocate(wpt);
+		/* Nothing to wait for if it only carried sentinels */
+		if (watchpoint_handler_count(wpt)
+		    && watchpoint_install_sentinel(wpt)) {
 			diag(LOG_CRIT,
 			     _("%s: failed to install sentinel; exiting now"),
 			     wpt->dirname);
@@ -308,34 +434,65 @@ watchpoint_suspend(struct watchpoint *wpt)
 	}
 }
 
+/*
+ * Sentinels are special handlers that set up watchers for newly created
+ * files and directories.  They are kept in a list of their own, so that
+ * the list of user handlers can be shared by all watchpoints created by
+ * recursing into a directory.
+ */
 struct sentinel {
 	struct handler *hp;
 	struct watchpoint *watchpoint;
 };
 
-static int
-sentinel_handler_run(struct watchpoint *wp, event_mask *event,
-		     const char *dirname, const char *file, void *data,
-		     int notify)
+static void
+sentinel_list_append(struct watchpoint *wpt, struct handler *hp)
 {
-	struct sentinel *sentinel = data;
-	struct watchpoint *wpt = sentinel->watchpoint;
+	if (!wpt->sentinel_list)
+		wpt->sentinel_list = handler_list_create();
+	handler_list_append(wpt->sentinel_list, hp);
+}
 
-	watchpoint_init(wpt);
-	watchpoint_install_ptr(wpt);
-	deliver_ev_create(wpt, dirname, file, notify);
-	
-	if (handler_list_remove(wp->handler_list, sentinel->hp) == 0) {
-		if (!watchpoint_gc_list) {
-			watchpoint_gc_list = grecs_list_create();
-			watchpoint_gc_list->free_entry = wpref_destroy;
-		}
-		grecs_list_append(watchpoint_gc_list, wp);
-	}
+/* Return the number of handlers and sentinels of WPT */
+static size_t
+watchpoint_handler_count(struct watchpoint *wpt)
+{
+	size_t n = 0;
 
-	return 0;
+	if (wpt->handler_list)
+		n += handler_list_size(wpt->handler_list);
+	if (wpt->sentinel_list)
+		n += handler_list_size(wpt->sentinel_list);
+	return n;
+}
+
+/* Schedule WPT for destruction by watchpoint_gc */
+static void
+watchpoint_gc_add(struct watchpoint *wpt)
+{
+	if (!watchpoint_gc_list) {
+		watchpoint_gc_list = grecs_list_create();
+		watchpoint_gc_list->free_entry = wpref_destroy;
+	}
+	grecs_list_append(watchpoint_gc_list, wpt);
 }
 
+/*
+ * CREATE sentinels wait for a watched pathname to appear.  A single
+ * sentinel is attached to the nearest existing ancestor of the pathname
+ * and watches for the creation of the next pathname component in it.
+ * When that component appears, the sentinel walks down to the deepest
+ * existing ancestor, so that several levels created at once (as by
+ * "mkdir -p") are followed without waiting for events that will never
+ * come.  Once the pathname itself exists, its watcher is set up.
+ *
+ * Thus, waiting for a pathname costs one watch no matter how many of
+ * its components are missing.
+ */
+static int sentinel_handler_run(struct watchpoint *wp, event_mask *event,
+				const char *dirname, const char *file,
+				void *data, int notify);
+
 static void
 sentinel_handler_free(void *ptr)
 {
@@ -344,18 +501,57 @@ sentinel_handler_free(void *ptr)
 	free(sentinel);
 }
 
-int
-watchpoint_install_sentinel(struct watchpoint *wpt)
+/*
+ * Return the name of the nearest existing ancestor of PATH in allocated
+ * memory, and store the next component of PATH (the one to wait for)
+ * in *PCOMP.  If SELF is set and PATH itself exists, return NULL.
+ */
+static char *
+sentinel_ancestor(char const *path, int self, char **pcomp)
+{
+	size_t start, end = strlen(path);
+	struct stat st;
+	char *dir;
+
+	if (self && stat(path, &st) == 0)
+		return NULL;
+	for (;;) {
+		for (start = end; start > 0 && path[start-1] != '/'; start--)
+			;
+		if (start == 0) {
+			dir = estrdup(".");
+			break;
+		}
+		for (end = start - 1; end > 0 && path[end-1] == '/'; end--)
+			;
+		if (end == 0) {
+			dir = estrdup("/");
+			break;
+		}
+		dir = emalloc(end + 1);
+		memcpy(dir, path, end);
+		dir[end] = 0;
+		if (stat(dir, &st) == 0)
+			break;
+		free(dir);
+	}
+	for (end = start; path[end] && path[end] != '/'; end++)
+		;
+	*pcomp = emalloc(end - start + 1);
+	memcpy(*pcomp, path + start, end - start);
+	(*pcomp)[end - start] = 0;
+	return dir;
+}
+
+/* Attach to SENT the sentinel waiting for the creation of NAME on the
+   way to WPT. */
+static struct handler *
+sentinel_attach(struct watchpoint *sent, struct watchpoint *wpt,
+		char const *name)
 {
-	struct watchpoint *sent;
-	char *dirname;
-	char *filename;
 	struct handler *hp;
 	event_mask ev_mask;
 	struct sentinel *sentinel;
-	
-	filename = split_pathname(wpt, &dirname);
-	sent = watchpoint_install(dirname, NULL);
 
 	getevt("create", &ev_mask);
 	hp = handler_alloc(ev_mask);
@@ -366,18 +562,196 @@ watchpoint_install_sentinel(struct watchpoint *wpt)
 	sentinel->watchpoint = wpt;
 	sentinel->hp = hp;
 	watchpoint_ref(wpt);
-	
+
 	hp->data = sentinel;
 	hp->notify_always = 1;
-	
-	filpatlist_add_exact(&hp->fnames, filename);
-	handler_list_append(sent->handler_list, hp);
+	/* Wait for it the same way it is to be watched */
+	hp->poll = watchpoint_poll_only(wpt);
+
+	filpatlist_add_exact(&hp->fnames, name);
+	sentinel_list_append(sent, hp);
+	return hp;
+}
+
+/* Remove the sentinel HP from SENT.  Discard SENT if nothing else is
+   watched there. */
+static void
+sentinel_detach(struct watchpoint *sent, struct handler *hp)
+{
+	handler_list_remove(sent->sentinel_list, hp);
+	if (watchpoint_handler_count(sent) == 0)
+		watchpoint_gc_add(sent);
+}
+
+/* The pathname of WPT has appeared: set up its watcher and report it. */
+static void
+sentinel_arrive(struct watchpoint *wpt, int notify)
+{
+	char *dirname, *filename;
+
+	watchpoint_init(wpt);
+	watchpoint_install_ptr(wpt);
+
+	filename = split_pathname(wpt, &dirname);
+	dirname = estrdup(dirname);
+	filename = estrdup(filename);
 	unsplit_pathname(wpt);
+	deliver_ev_create(wpt, dirname, filename, notify);
+	free(dirname);
+	free(filename);
+}
+
+/*
+ * Move the sentinel HP, waiting for WPT in the watchpoint SENT, to the
+ * nearest existing ancestor of WPT.  If HP is NULL, install a new
+ * sentinel.  If ARRIVE is set and the pathname of WPT exists, set up
+ * its watcher.
+ *
+ * The walk is repeated after setting up each new watch, so that the
+ * components created before the watch took effect are not missed.
+ */
+static int
+sentinel_walk(struct watchpoint *wpt, struct watchpoint *sent,
+	      struct handler *hp, int arrive, int notify)
+{
+	int rc = 0;
+
+	watchpoint_ref(wpt);
+	for (;;) {
+		char *dirname, *name;
+
+		dirname = sentinel_ancestor(wpt->dirname, arrive, &name);
+		if (!dirname) {
+			if (hp)
+				sentinel_detach(sent, hp);
+			sentinel_arrive(wpt, notify);
+			break;
+		}
+		if (hp && strcmp(sent->dirname, dirname) == 0) {
+			/* Still waiting in the same place */
+			free(dirname);
+			free(name);
+			break;
+		}
+		if (hp)
+			sentinel_detach(sent, hp);
+		debug(1, (_("%s: waiting for %s in %s"),
+			  wpt->dirname, name, dirname));
+		sent = watchpoint_install(dirname, NULL);
+		hp = sentinel_attach(sent, wpt, name);
+		free(dirname);
+		free(name);
+		if (!watchpoint_watched(sent) && watchpoint_init(sent)) {
+			rc = 1;
+			break;
+		}
+		arrive = 1;
+	}
+	watchpoint_unref(wpt);
+	return rc;
+}
+
+static int
+sentinel_handler_run(struct watchpoint *wp, event_mask *event,
+		     const char *dirname, const char *file, void *data,
+		     int notify)
+{
+	struct sentinel *sentinel = data;
+
+	sentinel_walk(sentinel->watchpoint, wp, sentinel->hp, 1, notify);
+	return 0;
+}
+
+/*
+ * Move the CREATE sentinels of WPT, whose directory is gone, to the
+ * nearest existing ancestors of their pathnames.
+ */
+static void
+sentinel_relocate(struct watchpoint *wpt)
+{
+	handler_iterator_t itr;
+	struct handler *hp;
+
+	for_each_handler(wpt, itr, hp) {
+		if (hp->run == sentinel_handler_run) {
+			struct sentinel *sentinel = hp->data;
+			struct watchpoint *target = sentinel->watchpoint;
+
+			watchpoint_ref(target);
+			handler_list_remove(wpt->sentinel_list, hp);
+			sentinel_walk(target, NULL, NULL, 0, 1);
+			watchpoint_unref(target);
+		}
+	}
+}
+
+int
+watchpoint_install_sentinel(struct watchpoint *wpt)
+{
 	diag(LOG_NOTICE, _("installing CREATE sentinel for %s"), wpt->dirname);
-	return watchpoint_init(sent);
+	return sentinel_walk(wpt, NULL, NULL, 0, 0);
 }
-
+
 static int watch_subdirs(struct watchpoint *parent, int notify);
+static struct watchpoint *watchpoint_root(struct watchpoint *wpt);
+
+/*
+ * Return 1 if the subdirectory NAME of PARENT must not be watched, i.e.
+ * if all handlers of PARENT exclude it.  Exclude patterns are matched
+ * against NAME and against its pathname relative to the top-level
+ * watched directory.
+ */
+static int
+watchpoint_excluded(struct watchpoint *parent, char const *name)
+{
+	struct watchpoint *root = watchpoint_root(parent);
+	handler_iterator_t itr;
+	struct handler *hp;
+	char *relpath;
+	size_t len;
+	int n = 0, excl = 0;
+
+	if (parent == root)
+		relpath = estrdup(name);
+	else {
+		len = strlen(root->dirname);
+		if (root->dirname[len-1] != '/')
+			len++;
+		relpath = mkfilename(parent->dirname + len, name);
+		if (!relpath)
+			nomem_abend();
+	}
+	for_each_handler(parent, itr, hp) {
+		if (hp->notify_always)
+			continue;
+		n++;
+		if (handler_excludes(hp, name, relpath))
+			excl++;
+	}
+	free(relpath);
+	return n > 0 && excl == n;
+}
+
+/* Entry being delivered by watch_subdirs, if any */
+static struct dirent *crawl_ent;
+
+/*
+ * Return true if FILE is the entry being delivered by the crawl, and
+ * its type, as reported by readdir, shows that it is not to be watched
+ * according to FILEMASK.  This spares a stat for each regular file.
+ */
+static int
+crawl_skip(char const *file, int filemask)
+{
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+	return crawl_ent
+		&& crawl_ent->d_type == DT_REG
+		&& !(filemask & S_IFREG)
+		&& strcmp(crawl_ent->d_name, file) == 0;
+#else
+	return 0;
+#endif
+}
 
 static int
 directory_sentinel_handler_run(struct watchpoint *wp, event_mask *event,
@@ -392,6 +766,8 @@ directory_sentinel_handler_run(struct watchpoint *wp, event_mask *event,
 	struct watchpoint *wpt;
 	int rc = 0;
 	
+	if (crawl_skip(file, filemask))
+		return 0;
 	filename = mkfilename(dirname, file);
 	if (!filename) {
 		diag(LOG_ERR,
@@ -405,6 +781,8 @@ directory_sentinel_handler_run(struct watchpoint *wp, event_mask *event,
 		     _("cannot create watcher %s, stat failed: %s"),
 		     filename, strerror(errno));
 		rc = -1;
+	} else if (S_ISDIR(st.st_mode) && watchpoint_excluded(parent, file)) {
+		debug(1, (_("%s: excluded"), filename));
 	} else if (st.st_mode & filemask) {
 		int inst;
 
@@ -415,15 +793,12 @@ directory_sentinel_handler_run(struct watchpoint *wp, event_mask *event,
 			if ((wpt->depth = parent->depth) > 0)
 				wpt->depth--;
 			
+			handler_list_unref(wpt->handler_list);
 			wpt->handler_list = handler_list_copy(parent->handler_list);
 			if (USE_IFACE == IFACE_KQUEUE || wpt->depth)
 				watchpoint_attach_directory_sentinel(wpt);
-			if (handler_list_remove_cow(&wpt->handler_list, sentinel->hp) == 0) {
-				if (!watchpoint_gc_list) {
-					watchpoint_gc_list = grecs_list_create();
-					watchpoint_gc_list->free_entry = wpref_destroy;
-				}
-				grecs_list_append(watchpoint_gc_list, wpt);
+			if (watchpoint_handler_count(wpt) == 0) {
+				watchpoint_gc_add(wpt);
 			} else {
 				wpt->parent = parent;
 		
@@ -461,7 +836,7 @@ watchpoint_attach_directory_sentinel(struct watchpoint *wpt)
 	hp->data = sentinel;
 	hp->notify_always = 1;
 	
-	handler_list_append_cow(&wpt->handler_list, hp);
+	sentinel_list_append(wpt, hp);
 	diag(LOG_NOTICE,
 	     wpt->isdir
 	       ? _("installing CREATE sentinel for %s/*")
@@ -471,15 +846,100 @@ watchpoint_attach_directory_sentinel(struct watchpoint *wpt)
 	return 0;
 }
 
-int 
-watchpoint_init(struct watchpoint *wpt)
+/* Compute the union of event masks of all handlers of WPT */
+void
+watchpoint_event_mask(struct watchpoint *wpt, event_mask *mask)
 {
-	struct stat st;
-	event_mask mask = { 0, 0 };
 	struct handler *hp;
 	handler_iterator_t itr;	
+
+	mask->sys_mask = mask->gen_mask = 0;
+	for_each_handler(wpt, itr, hp) {
+		mask->sys_mask |= hp->ev_mask.sys_mask;
+		mask->gen_mask |= hp->ev_mask.gen_mask;
+	}
+}
+
+/* Return true if a handler of WPT requires it to be polled */
+int
+watchpoint_poll_only(struct watchpoint *wpt)
+{
+	struct handler *hp;
+	handler_iterator_t itr;
+	int poll = 0;
+
+	for_each_handler(wpt, itr, hp)
+		if (hp->poll)
+			poll = 1;
+	return poll;
+}
+
+/* Number of kernel watches in use */
+size_t kernel_watches;
+
+/* Set a kernel watch on WPT.  Return 0 on success and -1 on error. */
+static int
+watchpoint_add_watch(struct watchpoint *wpt)
+{
+	event_mask mask;
 	int wd;
 
+	if (watch_budget_exhausted()) {
+		errno = ENOSPC;
+		return -1;
+	}
+	watchpoint_event_mask(wpt, &mask);
+	wd = sysev_add_watch(wpt, mask);
+	if (wd == -1)
+		return -1;
+	wpt->wd = wd;
+	kernel_watches++;
+	return 0;
+}
+
+/* Stop watching WPT, be it by a kernel watch or by polling. */
+static void
+watchpoint_rm_watch(struct watchpoint *wpt)
+{
+	if (wpt->wd != -1) {
+		sysev_rm_watch(wpt);
+		wpt->wd = -1;
+		kernel_watches--;
+	}
+	poll_remove(wpt);
+}
+
+/* Replace polling of WPT with a kernel watch. */
+int
+watchpoint_promote(struct watchpoint *wpt)
+{
+	/* Report the changes made since the last scan */
+	poll_flush(wpt);
+	if (!wpt->poll || watchpoint_add_watch(wpt))
+		return 1;
+	poll_remove(wpt);
+	debug(1, (_("%s: switched to kernel watch"), wpt->dirname));
+	return 0;
+}
+
+/* Replace the kernel watch of WPT with polling. */
+int
+watchpoint_demote(struct watchpoint *wpt)
+{
+	if (poll_add(wpt))
+		return 1;
+	sysev_rm_watch(wpt);
+	wpt->wd = -1;
+	kernel_watches--;
+	debug(1, (_("%s: switched to polling"), wpt->dirname));
+	return 0;
+}
+
+int 
+watchpoint_init(struct watchpoint *wpt)
+{
+	struct stat st;
+
 	debug(1, (_("creating watcher %s"), wpt->dirname));
 
 	if (stat(wpt->dirname, &st)) {
@@ -494,20 +954,17 @@ watchpoint_init(struct watchpoint *wpt)
 
 	wpt->isdir = S_ISDIR(st.st_mode);
 	
-	for_each_handler(wpt, itr, hp) {
-		mask.sys_mask |= hp->ev_mask.sys_mask;
-		mask.gen_mask |= hp->ev_mask.gen_mask;
-	}
-
-	wd = sysev_add_watch(wpt, mask);
-	if (wd == -1) {
+	if (watchpoint_poll_only(wpt))
+		return poll_add(wpt);
+	if (watchpoint_add_watch(wpt)) {
+		if (errno == ENOSPC || errno == EMFILE || errno == ENFILE)
+			/* Out of kernel watches */
+			return poll_fallback(wpt);
 		diag(LOG_ERR, _("cannot set watcher on %s: %s"),
 		     wpt->dirname, strerror(errno));
 		return 1;
 	}
 
-	wpt->wd = wd;
-
 	return 0;
 }
 
@@ -519,6 +976,7 @@ deliver_ev_create(struct watchpoint *wp, const char *dirname, const char *name,
 	event_mask event = { GENEV_CREATE, 0 };
 	struct handler *hp;
 	handler_iterator_t itr;
+	struct evstat es = EVSTAT_INIT(dirname, name);
 
 	if (watchpoint_recent_lookup(wp, name))
 		return;
@@ -526,8 +984,9 @@ deliver_ev_create(struct watchpoint *wp, const char *dirname, const char *name,
 	for_each_handler(wp, itr, hp) {
 		event_mask m;
 		if (evtand(&event, &hp->ev_mask, &m) &&
-		    filpatlist_match(hp->fnames, name) == 0 &&
-		    (notify || hp->notify_always))
+		    handler_file_match(hp, name) == 0 &&
+		    (notify || hp->notify_always) &&
+		    handler_attr_match(hp, &es) == 0)
 			hp->run(wp, &m, dirname, name, hp->data, notify);
 	}
 }
@@ -545,21 +1004,58 @@ watchpoint_pattern_match(struct watchpoint *wpt, const char *file_name)
 	return 1;
 }
 
-/* Recursively scan subdirectories of parent and add them to the
-   watcher list, as requested by the parent's recursion depth value. */
+/*
+ * Directory scans.
+ *
+ * Scanning a directory reports its entries to the sentinels, which set
+ * up watchers for the subdirectories, and, if NOTIFY is set, to the
+ * handlers as well.  The subdirectories are then scanned in turn.
+ *
+ * To keep a large directory or a deep tree from holding up the event
+ * dispatch, scans are kept in a queue of cursors and run in slices:
+ * each iteration of the main loop examines at most scan_slice entries,
+ * after the pending kernel events were handled.  Scans started while
+ * processing a slice are queued after the running ones, so trees are
+ * scanned breadth first.  The initial crawl is run to completion before
+ * any events are processed.
+ *
+ * While scans are in progress, the names of recently created entries
+ * are retained (see recent_rotate), so that the files the kernel
+ * reports before the scan gets to them are not reported twice.
+ */
+size_t scan_slice = SCAN_SLICE_DEFAULT;
+
+struct scan {
+	struct scan *next;              /* Next scan in queue */
+	struct watchpoint *wpt;         /* Directory being scanned */
+	DIR *dir;                       /* Directory stream */
+	int notify;                     /* Notify the handlers */
+	int snapshot_only;              /* Only compare with the snapshot */
+	size_t count;                   /* Entries examined so far */
+};
+
+static struct scan *scan_head, *scan_tail;
+static size_t scan_count;
+
+/* Statistics */
+static unsigned long stat_scans_started;
+static unsigned long stat_scan_entries;
+static unsigned long stat_scan_slices;
+
+/* Start scanning subdirectories of PARENT, as requested by its
+   recursion depth value. */
 static int
 watch_subdirs(struct watchpoint *parent, int notify)
 {
 	DIR *dir;
-	struct dirent *ent;
+	struct scan *sp;
 	int filemask;
-	int total = 0;
 
 	if (!parent->isdir)
 		return 0;
 
 	filemask = watchpoint_filemask(parent);
-	if (filemask == 0 && !notify) {
+	if (filemask == 0 && !notify && !snapshot_loaded()) {
 		return 0;
 	}
 	
@@ -569,57 +1065,163 @@ watch_subdirs(struct watchpoint *parent, int notify)
 		     parent->dirname, strerror(errno));
 		return 0;
 	}
+	if (!notify)
+		snapshot_scan_dir(parent);
+
+	sp = emalloc(sizeof(*sp));
+	sp->next = NULL;
+	sp->wpt = parent;
+	watchpoint_ref(parent);
+	sp->dir = dir;
+	sp->notify = notify;
+	/* The snapshot covers the directory entries, whether they are
+	   watched or not */
+	sp->snapshot_only = filemask == 0 && !notify;
+	sp->count = 0;
+	if (scan_tail)
+		scan_tail->next = sp;
+	else
+		scan_head = sp;
+	scan_tail = sp;
+	scan_count++;
+	stat_scans_started++;
+	return 0;
+}
 
-	while (1) {
-		struct stat st;
-		char *dirname;
+/* Examine the next entry of the scan SP.  Return 1 if there are no more
+   entries, and 0 otherwise. */
+static int
+scan_step(struct scan *sp)
+{
+	struct watchpoint *parent = sp->wpt;
+	struct dirent *ent;
+	struct stat st;
+	char *dirname;
+	int notify = sp->notify;
 
+	if (!watchpoint_watched(parent)) {
+		debug(1, (_("%s: scan abandoned"), parent->dirname));
+		return 1;
+	}
+
+	do {
 		errno = 0;
-		ent = readdir(dir);
+		ent = readdir(sp->dir);
 		if (!ent) {
 			if (errno)
 				diag(LOG_ERR, "readdir(%s): %s",
 				     parent->dirname, strerror(errno));
-			break;
-		}
-		
-		if (ent->d_name[0] == '.' &&
-		    (ent->d_name[1] == 0 ||
-		     (ent->d_name[1] == '.' && ent->d_name[2] == 0)))
-			continue;
-		
-		dirname = mkfilename(parent->dirname, ent->d_name);
-		if (!dirname) {
-			diag(LOG_ERR,
-			     _("cannot stat %s/%s: not enough memory"),
-			     parent->dirname, ent->d_name);
-			continue;
+			return 1;
 		}
-		if (watchpoint_lookup(dirname))
-			/* Skip existing watchpoint */;
-		else if (stat(dirname, &st)) {
-			diag(LOG_ERR, _("cannot stat %s: %s"),
-			     dirname, strerror(errno));
-		} else if (watchpoint_pattern_match(parent, ent->d_name)
-			   == 0) {
+	} while (ent->d_name[0] == '.' &&
+		 (ent->d_name[1] == 0 ||
+		  (ent->d_name[1] == '.' && ent->d_name[2] == 0)));
+	sp->count++;
+	stat_scan_entries++;
+
+	dirname = mkfilename(parent->dirname, ent->d_name);
+	if (!dirname) {
+		diag(LOG_ERR,
+		     _("cannot stat %s/%s: not enough memory"),
+		     parent->dirname, ent->d_name);
+		return 0;
+	}
+	if (watchpoint_lookup(dirname)) {
+		/* Skip existing watchpoint */
+		if (!notify)
+			snapshot_check(parent, dirname, ent->d_name, NULL);
+	} else if (!notify && snapshot_loaded()
+		   && dirent_stat(sp->dir, parent->dirname, ent->d_name,
+				  &st, 1)) {
+		diag(LOG_ERR, _("cannot stat %s: %s"),
+		     dirname, strerror(errno));
+	} else {
+		if (!notify && snapshot_loaded())
+			snapshot_check(parent, dirname, ent->d_name, &st);
+		if (!sp->snapshot_only
+		    && watchpoint_pattern_match(parent, ent->d_name) == 0) {
+			struct dirent *saved_ent = crawl_ent;
+			crawl_ent = ent;
 			deliver_ev_create(parent, parent->dirname,
 					  ent->d_name, notify);
+			crawl_ent = saved_ent;
 		}
-		free(dirname);
 	}
-	closedir(dir);
-	return total;
+	free(dirname);
+	return 0;
+}
+
+/*
+ * Run the queued scans, examining at most LIMIT entries (0 means no
+ * limit).  Return the number of scans left.
+ */
+size_t
+scan_run(size_t limit)
+{
+	size_t n = 0;
+
+	if (!scan_head)
+		return 0;
+	stat_scan_slices++;
+	while (scan_head && (limit == 0 || n < limit)) {
+		struct scan *sp = scan_head;
+
+		if (scan_step(sp)) {
+			debug(1, (_("%s: scan finished, %lu entries"),
+				  sp->wpt->dirname, (unsigned long) sp->count));
+			scan_head = sp->next;
+			if (!scan_head)
+				scan_tail = NULL;
+			scan_count--;
+			closedir(sp->dir);
+			watchpoint_unref(sp->wpt);
+			free(sp);
+		} else
+			n++;
+	}
+	return scan_count;
+}
+
+/* Return the number of scans in progress */
+size_t
+scan_pending(void)
+{
+	return scan_count;
+}
+
+void
+scan_stats(void)
+{
+	diag(LOG_INFO,
+	     _("scans: %lu in progress, %lu started, %lu entries examined "
+	       "in %lu slices"),
+	     (unsigned long) scan_count, stat_scans_started,
+	     stat_scan_entries, stat_scan_slices);
+	if (scan_head)
+		diag(LOG_INFO, _("scanning %s: %lu entries examined"),
+		     scan_head->wpt->dirname,
+		     (unsigned long) scan_head->count);
+}
+
+
+static void watchpoint_glob_scan(struct watchpoint *wpt, int notify);
+
+static void
+setwatcher_init(struct watchpoint *wpt)
+{
+	if (!watchpoint_watched(wpt) && watchpoint_init(wpt) == 0) {
+		if (wpt->isspine)
+			watchpoint_glob_scan(wpt, 0);
+		else
+			watch_subdirs(wpt, 0);
+	}
 }
 
-
 static int
 setwatcher(void *ent, void *data)
 {
 	struct wpref *wpref = (struct wpref *) ent;
-	struct watchpoint *wpt = wpref->wpt;
-	
-	if (wpt->wd == -1 && watchpoint_init(wpt) == 0)
-		watch_subdirs(wpt, 0);
+	setwatcher_init(wpref->wpt);
 	return 0;
 }
 
@@ -628,7 +1230,7 @@ checkwatcher(void *ent, void *data)
 {
 	struct wpref *wpref = (struct wpref *) ent;
 	struct watchpoint *wpt = wpref->wpt;
-	return wpt->wd >= 0;
+	return watchpoint_watched(wpt);
 }
 	
 void
@@ -639,7 +1241,11 @@ setup_watchers(void)
 		diag(LOG_CRIT, _("no event handlers configured"));
 		exit(1);
 	}
+	snapshot_load();
 	grecs_symtab_foreach(nametab, setwatcher, NULL);
+	/* Complete the initial crawl */
+	scan_run(0);
+	snapshot_scan_done();
 	if (!grecs_symtab_foreach(nametab, checkwatcher, NULL)) {
 		diag(LOG_CRIT, _("no event handlers installed"));
 		exit(2);
@@ -651,13 +1257,39 @@ stopwatcher(void *ent, void *data)
 {
 	struct wpref *wpref = (struct wpref *) ent;
 	struct watchpoint *wpt = wpref->wpt;
-	if (wpt->wd != -1) {
+	if (watchpoint_watched(wpt)) {
 		debug(1, (_("removing watcher %s"), wpt->dirname));
-		sysev_rm_watch(wpt);
+		watchpoint_rm_watch(wpt);
 	}
 	return 0;
 }
 
+struct watchpoint_closure {
+	int (*fn)(struct watchpoint *, void *);
+	void *data;
+};
+
+static int
+watchpoint_foreach_helper(void *ent, void *data)
+{
+	struct wpref *wpref = (struct wpref *) ent;
+	struct watchpoint_closure *clos = data;
+	return clos->fn(wpref->wpt, clos->data);
+}
+
+/* Call FN for each watchpoint.  Stop if it returns non-zero. */
+void
+watchpoint_foreach(int (*fn)(struct watchpoint *, void *), void *data)
+{
+	struct watchpoint_closure clos;
+
+	if (!nametab)
+		return;
+	clos.fn = fn;
+	clos.data = data;
+	grecs_symtab_foreach(nametab, watchpoint_foreach_helper, &clos);
+}
+
 void
 shutdown_watchers(void)
 {
@@ -666,6 +1298,826 @@ shutdown_watchers(void)
 }
 
 
+/*
+ * Glob patterns.
+ *
+ * A configured pathname with wildcards in its components (e.g. with
+ * a `*' in place of a directory name) is watched by expanding the
+ * pattern as directories appear.  Its longest leading part without
+ * wildcards (the base) and each directory that matches a leading part
+ * of the pattern are watched as "spine" watchpoints.  Spines have no
+ * user handlers: the glob sentinel attached to each of them sets up the
+ * next spine or, at the last component, a leaf watchpoint with the
+ * configured handlers, when a matching entry is created.  Spines and
+ * leaves are removed along with the directories they watch.
+ */
+struct globspec {
+	size_t refcnt;
+	long depth;             /* Recursion depth of the leaves */
+	handler_list_t hlist;   /* Handlers of the leaves */
+	size_t ncomp;           /* Number of pattern components */
+	char **comp;            /* Pattern components following the base */
+};
+
+struct glob_sentinel {
+	struct handler *hp;
+	struct watchpoint *watchpoint;  /* Spine it is attached to */
+	struct globspec *spec;
+	size_t level;                   /* Index of the component to match */
+};
+
+static void watchpoint_discard(struct watchpoint *wpt);
+
+/* Return 1 if pathname S contains wildcard characters. */
+int
+is_glob_pattern(char const *s)
+{
+	return strpbrk(s, "*?[") != NULL;
+}
+
+/*
+ * Create a glob specification for PATTERN.  Store the base directory
+ * in *PBASE.
+ */
+static struct globspec *
+globspec_create(char const *pattern, long depth, handler_list_t hlist,
+		char **pbase)
+{
+	struct globspec *spec = ecalloc(1, sizeof(*spec));
+	char const *p, *base_end = pattern;
+	size_t n;
+
+	spec->refcnt = 1;
+	spec->depth = depth;
+	spec->hlist = handler_list_copy(hlist);
+
+	/* Find the first component with wildcards */
+	for (p = pattern; *p; p += n) {
+		p += strspn(p, "/");
+		n = strcspn(p, "/");
+		if (n == 0)
+			break;
+		if (memchr(p, '*', n) || memchr(p, '?', n) || memchr(p, '[', n))
+			break;
+		base_end = p + n;
+	}
+	if (base_end == pattern)
+		*pbase = estrdup("/");
+	else {
+		*pbase = emalloc(base_end - pattern + 1);
+		memcpy(*pbase, pattern, base_end - pattern);
+		(*pbase)[base_end - pattern] = 0;
+	}
+
+	/* Split the rest into components */
+	for (p = base_end; *p; p += n) {
+		p += strspn(p, "/");
+		n = strcspn(p, "/");
+		if (n == 0)
+			break;
+		spec->comp = erealloc(spec->comp,
+				      (spec->ncomp + 1) * sizeof(spec->comp[0]));
+		spec->comp[spec->ncomp] = emalloc(n + 1);
+		memcpy(spec->comp[spec->ncomp], p, n);
+		spec->comp[spec->ncomp][n] = 0;
+		spec->ncomp++;
+	}
+	return spec;
+}
+
+static void
+globspec_unref(struct globspec *spec)
+{
+	size_t i;
+
+	if (!spec || --spec->refcnt)
+		return;
+	for (i = 0; i < spec->ncomp; i++)
+		free(spec->comp[i]);
+	free(spec->comp);
+	handler_list_unref(spec->hlist);
+	free(spec);
+}
+
+static int glob_sentinel_run(struct watchpoint *wp, event_mask *event,
+			     const char *dirname, const char *file,
+			     void *data, int notify);
+
+static void
+glob_sentinel_free(void *ptr)
+{
+	struct glob_sentinel *gs = ptr;
+	globspec_unref(gs->spec);
+	watchpoint_unref(gs->watchpoint);
+	free(gs);
+}
+
+static struct glob_sentinel *
+glob_sentinel_attach(struct watchpoint *wpt, struct globspec *spec,
+		     size_t level)
+{
+	struct handler *hp;
+	event_mask ev_mask;
+	struct glob_sentinel *gs;
+
+	/* Deletions are needed to remove the watchers of matching entries
+	   (see remove_watcher) */
+	getevt("create", &ev_mask);
+	ev_mask.gen_mask |= GENEV_DELETE;
+	hp = handler_alloc(ev_mask);
+	hp->run = glob_sentinel_run;
+	hp->free = glob_sentinel_free;
+
+	gs = emalloc(sizeof(*gs));
+	gs->hp = hp;
+	gs->watchpoint = wpt;
+	watchpoint_ref(wpt);
+	gs->spec = spec;
+	spec->refcnt++;
+	gs->level = level;
+
+	hp->data = gs;
+	hp->notify_always = 1;
+	sentinel_list_append(wpt, hp);
+	wpt->isspine = 1;
+	return gs;
+}
+
+static void glob_scan(struct glob_sentinel *gs, int notify);
+
+/*
+ * The entry NAME appeared in the spine of GS.  If it matches the
+ * pattern component, set up a watchpoint for it: a leaf, if it is the
+ * last component, and the next spine otherwise.
+ */
+static void
+glob_expand(struct glob_sentinel *gs, char const *name, int notify)
+{
+	struct watchpoint *spine = gs->watchpoint;
+	struct globspec *spec = gs->spec;
+	int last = gs->level + 1 == spec->ncomp;
+	char *path;
+	struct stat st;
+	struct watchpoint *wpt;
+	int inst;
+
+	if (fnmatch(spec->comp[gs->level], name, FNM_PERIOD))
+		return;
+	path = mkfilename(spine->dirname, name);
+	if (!path)
+		nomem_abend();
+	if (stat(path, &st)) {
+		if (errno != ENOENT)
+			diag(LOG_ERR, _("cannot stat %s: %s"),
+			     path, strerror(errno));
+		free(path);
+		return;
+	}
+	if (!last && !S_ISDIR(st.st_mode)) {
+		free(path);
+		return;
+	}
+
+	wpt = watchpoint_install(path, &inst);
+	free(path);
+	if (!inst) {
+		debug(1, (_("%s: already watched"), wpt->dirname));
+		watchpoint_unref(wpt);
+		return;
+	}
+	wpt->parent = spine;
+	if (last) {
+		wpt->depth = spec->depth;
+		handler_list_unref(wpt->handler_list);
+		wpt->handler_list = handler_list_copy(spec->hlist);
+		if (USE_IFACE == IFACE_KQUEUE || wpt->depth)
+			watchpoint_attach_directory_sentinel(wpt);
+		if (watchpoint_init(wpt)) {
+			watchpoint_discard(wpt);
+			return;
+		}
+		debug(1, (_("%s: matches glob pattern"), wpt->dirname));
+		watchpoint_recent_init(wpt);
+		watch_subdirs(wpt, notify);
+	} else {
+		struct glob_sentinel *next = glob_sentinel_attach(wpt, spec,
+								  gs->level + 1);
+		if (watchpoint_init(wpt)) {
+			watchpoint_discard(wpt);
+			return;
+		}
+		glob_scan(next, notify);
+	}
+}
+
+/* Expand the pattern for the entries already present in the spine. */
+static void
+glob_scan(struct glob_sentinel *gs, int notify)
+{
+	struct watchpoint *spine = gs->watchpoint;
+	DIR *dir;
+	struct dirent *ent;
+
+	dir = opendir(spine->dirname);
+	if (!dir) {
+		diag(LOG_ERR, _("cannot open directory %s: %s"),
+		     spine->dirname, strerror(errno));
+		return;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.' &&
+		    (ent->d_name[1] == 0 ||
+		     (ent->d_name[1] == '.' && ent->d_name[2] == 0)))
+			continue;
+		glob_expand(gs, ent->d_name, notify);
+	}
+	closedir(dir);
+}
+
+static int
+glob_sentinel_run(struct watchpoint *wp, event_mask *event,
+		  const char *dirname, const char *file,
+		  void *data, int notify)
+{
+	struct glob_sentinel *gs = data;
+
+	if (!(event->gen_mask & GENEV_CREATE))
+		return 0;
+	if (strcmp(dirname, gs->watchpoint->dirname))
+		/* The spine directory itself was created (see
+		   sentinel_handler_run) */
+		glob_scan(gs, notify);
+	else
+		glob_expand(gs, file, notify);
+	return 0;
+}
+
+/* Expand the glob patterns of the spine WPT for its existing entries. */
+static void
+watchpoint_glob_scan(struct watchpoint *wpt, int notify)
+{
+	struct handler *hp;
+	handler_iterator_t itr;
+
+	for_each_handler(wpt, itr, hp)
+		if (hp->run == glob_sentinel_run)
+			glob_scan(hp->data, notify);
+}
+
+/*
+ * Install the base spine for the glob PATTERN.  Return the watchpoint,
+ * or NULL if the base directory is already watched.  Store the glob
+ * specification in *PSPEC.
+ */
+static struct watchpoint *
+glob_install(char const *pattern, long depth, handler_list_t hlist,
+	     struct globspec **pspec)
+{
+	char *base;
+	struct globspec *spec = globspec_create(pattern, depth, hlist, &base);
+	struct watchpoint *wpt;
+	int isnew;
+
+	wpt = watchpoint_install(base, &isnew);
+	if (!isnew) {
+		diag(LOG_WARNING,
+		     _("%s: base directory %s is already watched by another "
+		       "watcher; ignoring"),
+		     pattern, base);
+		watchpoint_unref(wpt);
+		globspec_unref(spec);
+		free(base);
+		return NULL;
+	}
+	free(base);
+	glob_sentinel_attach(wpt, spec, 0);
+	*pspec = spec;
+	return wpt;
+}
+
+/* Replace the handlers of the leaves created for SPEC from now on */
+static void
+globspec_set_handlers(struct globspec *spec, handler_list_t hlist)
+{
+	handler_list_unref(spec->hlist);
+	spec->hlist = handler_list_copy(hlist);
+}
+
+
+/* Configured watchpoints */
+
+struct watchconf {
+	char *name;              /* Pathname (symtab key) */
+	long depth;              /* Recursion depth */
+	handler_list_t hlist;    /* Configured handlers */
+	struct watchpoint *wpt;  /* Watchpoint installed for it */
+	struct globspec *glob;   /* Glob specification, if NAME is a pattern */
+};
+
+/* Configuration in effect */
+static struct grecs_symtab *watchconf_tab;
+/* Configuration being parsed */
+static struct grecs_symtab *watchconf_new;
+
+static void
+watchconf_free(void *ptr)
+{
+	struct watchconf *wc = ptr;
+	handler_list_unref(wc->hlist);
+	if (wc->wpt)
+		watchpoint_unref(wc->wpt);
+	globspec_unref(wc->glob);
+	free(wc->name);
+	free(wc);
+}
+
+/*
+ * Register handler HP for pathname PATH with the given recursion DEPTH
+ * in the configuration being parsed.  Return -1 if PATH was already
+ * registered with another depth.
+ */
+int
+watchconf_add(char const *path, long depth, struct handler *hp)
+{
+	struct watchconf key, *wc;
+	int install = 1;
+
+	if (!watchconf_new) {
+		watchconf_new = grecs_symtab_create(sizeof(struct watchconf),
+						    NULL, NULL, NULL, NULL,
+						    watchconf_free);
+		if (!watchconf_new)
+			nomem_abend();
+	}
+	key.name = (char *) path;
+	wc = grecs_symtab_lookup_or_install(watchconf_new, &key, &install);
+	if (!wc)
+		nomem_abend();
+	if (install) {
+		wc->depth = depth;
+		wc->hlist = handler_list_create();
+		wc->wpt = NULL;
+		wc->glob = NULL;
+	}
+	handler_list_append(wc->hlist, hp);
+	return wc->depth == depth ? 0 : -1;
+}
+
+/* Discard the configuration being parsed */
+void
+watchconf_discard(void)
+{
+	grecs_symtab_free(watchconf_new);
+	watchconf_new = NULL;
+}
+
+static grecs_list_ptr_t watchpoint_descendants(struct watchpoint *root);
+static void watchpoint_rebase(struct watchpoint *wpt, handler_list_t hlist);
+
+static int
+watchpoint_has_directory_sentinel(struct watchpoint *wpt)
+{
+	handler_iterator_t itr;
+	struct handler *hp;
+	int found = 0;
+
+	for_each_handler(wpt, itr, hp)
+		if (hp->run == directory_sentinel_handler_run)
+			found = 1;
+	return found;
+}
+
+/*
+ * The pathname of WC is already watched as a part of another watcher
+ * (e.g. a subdirectory of a recursive one) or as an owner of sentinels.
+ * This happens when it is added by reloading the configuration.  Make
+ * WPT a top-level watcher with the configured handlers, as if it were
+ * installed at startup.  The subtree set up by the other watcher is
+ * discarded and crawled anew with the configured depth.
+ */
+static void
+watchconf_adopt(struct watchconf *wc, struct watchpoint *wpt)
+{
+	grecs_list_ptr_t list;
+	struct grecs_list_entry *ep;
+
+	debug(1, (_("%s: taking over from another watcher"), wc->name));
+	wpt->parent = NULL;
+	list = watchpoint_descendants(wpt);
+	for (ep = list->head; ep; ep = ep->next)
+		watchpoint_discard(ep->data);
+	grecs_list_free(list);
+
+	wpt->depth = wc->depth;
+	if ((USE_IFACE == IFACE_KQUEUE || wpt->depth)
+	    && !watchpoint_has_directory_sentinel(wpt))
+		watchpoint_attach_directory_sentinel(wpt);
+	watchpoint_rebase(wpt, wc->hlist);
+	if (watchpoint_watched(wpt))
+		watch_subdirs(wpt, 0);
+	else
+		setwatcher_init(wpt);
+}
+
+/*
+ * Install watchpoint for the configured pathname.  If SETUP is true,
+ * start watching it immediately.
+ */
+static int
+watchconf_install(void *sym, void *data)
+{
+	struct watchconf *wc = sym;
+	int setup = *(int *) data;
+	struct watchpoint *wpt;
+	int isnew;
+
+	if (wc->wpt)
+		return 0;
+	if (is_glob_pattern(wc->name)) {
+		wpt = glob_install(wc->name, wc->depth, wc->hlist, &wc->glob);
+		if (!wpt)
+			return 0;
+		watchpoint_ref(wpt);
+		wc->wpt = wpt;
+		if (setup)
+			setwatcher_init(wpt);
+		return 0;
+	}
+	wpt = watchpoint_install(wc->name, &isnew);
+	if (!isnew) {
+		if (wpt->isspine) {
+			diag(LOG_WARNING,
+			     _("%s is already watched as a part of another "
+			       "watcher; ignoring"),
+			     wc->name);
+			watchpoint_unref(wpt);
+		} else {
+			watchconf_adopt(wc, wpt);
+			wc->wpt = wpt;
+		}
+		return 0;
+	}
+	wpt->depth = wc->depth;
+	if (USE_IFACE == IFACE_KQUEUE || wpt->depth)
+		watchpoint_attach_directory_sentinel(wpt);
+	handler_list_unref(wpt->handler_list);
+	wpt->handler_list = handler_list_copy(wc->hlist);
+	watchpoint_ref(wpt);
+	wc->wpt = wpt;
+	if (setup)
+		setwatcher_init(wpt);
+	return 0;
+}
+
+/* Install the parsed configuration at startup */
+void
+watchconf_commit(void)
+{
+	int setup = 0;
+
+	if (!watchconf_new)
+		return;
+	grecs_symtab_foreach(watchconf_new, watchconf_install, &setup);
+	watchconf_tab = watchconf_new;
+	watchconf_new = NULL;
+}
+
+static struct watchpoint *
+watchpoint_root(struct watchpoint *wpt)
+{
+	while (wpt->parent)
+		wpt = wpt->parent;
+	return wpt;
+}
+
+static void
+watchpoint_unref_entry(void *ptr)
+{
+	watchpoint_unref(ptr);
+}
+
+static grecs_list_ptr_t
+watchpoint_list_create(void)
+{
+	grecs_list_ptr_t list = grecs_list_create();
+	list->free_entry = watchpoint_unref_entry;
+	return list;
+}
+
+static void
+watchpoint_list_append(grecs_list_ptr_t list, struct watchpoint *wpt)
+{
+	watchpoint_ref(wpt);
+	grecs_list_append(list, wpt);
+}
+
+struct descendant_closure {
+	struct watchpoint *root;
+	grecs_list_ptr_t list;
+};
+
+static int
+collect_descendant(struct watchpoint *wpt, void *data)
+{
+	struct descendant_closure *clos = data;
+	if (wpt != clos->root && watchpoint_root(wpt) == clos->root)
+		watchpoint_list_append(clos->list, wpt);
+	return 0;
+}
+
+/* Return a list of watchpoints created by crawling ROOT */
+static grecs_list_ptr_t
+watchpoint_descendants(struct watchpoint *root)
+{
+	struct descendant_closure clos;
+
+	clos.root = root;
+	clos.list = watchpoint_list_create();
+	watchpoint_foreach(collect_descendant, &clos);
+	return clos.list;
+}
+
+static int
+collect_subtree(struct watchpoint *wpt, void *data)
+{
+	struct descendant_closure *clos = data;
+	struct watchpoint *p;
+
+	for (p = wpt; p; p = p->parent)
+		if (p == clos->root) {
+			watchpoint_list_append(clos->list, wpt);
+			break;
+		}
+	return 0;
+}
+
+/*
+ * Stop watching the directories found by expanding the glob patterns of
+ * the spine WPT.  They are not necessarily gone along with it: if it
+ * was renamed, they would remain watched under their old names.
+ */
+static void
+spine_discard_descendants(struct watchpoint *wpt)
+{
+	struct descendant_closure clos;
+	struct grecs_list_entry *ep;
+
+	clos.root = wpt;
+	clos.list = watchpoint_list_create();
+	watchpoint_foreach(collect_subtree, &clos);
+	for (ep = clos.list->head; ep; ep = ep->next)
+		if (ep->data != wpt)
+			watchpoint_discard(ep->data);
+	grecs_list_free(clos.list);
+}
+
+/*
+ * The directory OLDNAME in the watched directory SRC was renamed to
+ * NEWNAME in DST.  If it is watched, and its new location is covered
+ * by the same recursive watcher at the same depth, rename the
+ * watchpoints of the moved subtree in place, retaining their watch
+ * descriptors.  Return 0 on success and -1 if the subtree must be
+ * watched anew.
+ */
+int
+watchpoint_move(struct watchpoint *src, char const *oldname,
+		struct watchpoint *dst, char const *newname)
+{
+	char *oldpath, *newpath;
+	size_t oldlen;
+	struct watchpoint *wpt;
+	struct descendant_closure clos;
+	struct grecs_list_entry *ep;
+	long depth;
+	int rc = -1;
+
+	oldpath = mkfilename(src->dirname, oldname);
+	newpath = mkfilename(dst->dirname, newname);
+	if (!oldpath || !newpath)
+		goto end;
+
+	wpt = watchpoint_lookup(oldpath);
+	if (!wpt || wpt->parent != src || !watchpoint_watched(wpt)
+	    || watchpoint_root(src) != watchpoint_root(dst)
+	    || dst->depth == 0
+	    || watchpoint_lookup(newpath)
+	    || watchpoint_excluded(dst, newname))
+		goto end;
+	if ((depth = dst->depth) > 0)
+		depth--;
+	if (depth != wpt->depth)
+		goto end;
+
+	clos.root = wpt;
+	clos.list = watchpoint_list_create();
+	watchpoint_foreach(collect_subtree, &clos);
+
+	oldlen = strlen(oldpath);
+	for (ep = clos.list->head; ep; ep = ep->next) {
+		struct watchpoint *p = ep->data;
+		char *suffix = p->dirname + oldlen;
+		char *name = emalloc(strlen(newpath) + strlen(suffix) + 1);
+
+		strcat(strcpy(name, newpath), suffix);
+		watchpoint_remove(p->dirname);
+		free(p->dirname);
+		p->dirname = name;
+		watchpoint_install_ptr(p);
+	}
+	wpt->parent = dst;
+	debug(1, (_("%s: moved to %s with %lu subordinate watchers"),
+		  oldpath, newpath,
+		  (unsigned long) grecs_list_size(clos.list) - 1));
+	grecs_list_free(clos.list);
+	rc = 0;
+ end:
+	free(oldpath);
+	free(newpath);
+	return rc;
+}
+
+/*
+ * Replace the handlers of WPT with the ones from HLIST, retaining its
+ * sentinels.  The watch descriptor is preserved, but its event mask is
+ * updated to match the new handlers.
+ */
+static void
+watchpoint_rebase(struct watchpoint *wpt, handler_list_t hlist)
+{
+	event_mask mask;
+
+	handler_list_unref(wpt->handler_list);
+	wpt->handler_list = handler_list_copy(hlist);
+
+	if (wpt->wd != -1) {
+		if (watchpoint_poll_only(wpt)) {
+			watchpoint_demote(wpt);
+			return;
+		}
+		watchpoint_event_mask(wpt, &mask);
+		if (sysev_mod_watch(wpt, mask))
+			diag(LOG_ERR, _("cannot update watcher %s: %s"),
+			     wpt->dirname, strerror(errno));
+	}
+}
+
+/* Stop watching WPT and break its reference cycles. */
+static void
+watchpoint_discard(struct watchpoint *wpt)
+{
+	debug(1, (_("removing watcher %s"), wpt->dirname));
+	watchpoint_recent_deinit(wpt);
+	watchpoint_rm_watch(wpt);
+	watchpoint_remove(wpt->dirname);
+	handler_list_unref(wpt->handler_list);
+	wpt->handler_list = NULL;
+	handler_list_unref(wpt->sentinel_list);
+	wpt->sentinel_list = NULL;
+}
+
+struct sentinel_closure {
+	struct watchpoint *target;
+	grecs_list_ptr_t list;
+};
+
+static int
+collect_sentinel_owner(struct watchpoint *wpt, void *data)
+{
+	struct sentinel_closure *clos = data;
+	struct handler *hp;
+	handler_iterator_t itr;
+
+	for_each_handler(wpt, itr, hp) {
+		if (hp->run == sentinel_handler_run &&
+		    ((struct sentinel *)hp->data)->watchpoint == clos->target)
+			watchpoint_list_append(clos->list, wpt);
+	}
+	return 0;
+}
+
+/*
+ * Remove the sentinel waiting for creation of WPT.  Destroy the
+ * watchpoint it was attached to, if it has no more handlers.
+ */
+static void
+watchpoint_remove_sentinel(struct watchpoint *wpt)
+{
+	struct sentinel_closure clos;
+	struct grecs_list_entry *ep;
+
+	clos.target = wpt;
+	clos.list = watchpoint_list_create();
+	watchpoint_foreach(collect_sentinel_owner, &clos);
+	for (ep = clos.list->head; ep; ep = ep->next) {
+		struct watchpoint *owner = ep->data;
+		struct handler *hp;
+		handler_iterator_t itr;
+
+		for_each_handler(owner, itr, hp) {
+			if (hp->run == sentinel_handler_run &&
+			    ((struct sentinel *)hp->data)->watchpoint == wpt)
+				handler_list_remove(owner->sentinel_list, hp);
+		}
+		if (watchpoint_handler_count(owner) == 0) {
+			/* The owner may itself wait for its parent */
+			watchpoint_remove_sentinel(owner);
+			watchpoint_discard(owner);
+		}
+	}
+	grecs_list_free(clos.list);
+}
+
+/* Remove the configured watchpoint WPT along with its descendants */
+static void
+watchconf_remove(struct watchpoint *wpt)
+{
+	grecs_list_ptr_t list = watchpoint_descendants(wpt);
+	struct grecs_list_entry *ep;
+
+	watchpoint_remove_sentinel(wpt);
+	for (ep = list->head; ep; ep = ep->next)
+		watchpoint_discard(ep->data);
+	grecs_list_free(list);
+	watchpoint_discard(wpt);
+}
+
+static int
+watchconf_update(void *sym, void *data)
+{
+	struct watchconf *old = sym, key, *wc;
+	grecs_list_ptr_t removed = data;
+
+	if (!old->wpt)
+		return 0;
+	key.name = old->name;
+	wc = grecs_symtab_lookup_or_install(watchconf_new, &key, NULL);
+	if (wc && wc->depth == old->depth) {
+		grecs_list_ptr_t list;
+		struct grecs_list_entry *ep;
+
+		debug(1, (_("updating watcher %s"), old->name));
+		if (!old->wpt->isspine)
+			watchpoint_rebase(old->wpt, wc->hlist);
+		list = watchpoint_descendants(old->wpt);
+		for (ep = list->head; ep; ep = ep->next) {
+			struct watchpoint *wpt = ep->data;
+			if (!wpt->isspine)
+				watchpoint_rebase(wpt, wc->hlist);
+		}
+		grecs_list_free(list);
+		wc->wpt = old->wpt;
+		if (old->glob) {
+			globspec_set_handlers(old->glob, wc->hlist);
+			wc->glob = old->glob;
+			old->glob = NULL;
+		}
+	} else
+		grecs_list_append(removed, old->wpt);
+	old->wpt = NULL;
+	return 0;
+}
+
+/*
+ * Replace the configuration in effect with the one just parsed.  The
+ * watchpoints present in both configurations with the same recursion
+ * depth are retained and only get their handlers replaced.  Removed
+ * watchpoints are destroyed, and added ones are set up.
+ */
+int
+watchconf_reload(void)
+{
+	grecs_list_ptr_t removed;
+	struct grecs_list_entry *ep;
+	int setup = 1;
+
+	if (!watchconf_new || grecs_symtab_count(watchconf_new) == 0) {
+		diag(LOG_ERR, _("no event handlers configured"));
+		watchconf_discard();
+		return -1;
+	}
+
+	removed = watchpoint_list_create();
+	if (watchconf_tab)
+		grecs_symtab_foreach(watchconf_tab, watchconf_update, removed);
+	/* The list now holds the only references to removed watchpoints */
+	for (ep = removed->head; ep; ep = ep->next)
+		watchconf_remove(ep->data);
+	grecs_list_free(removed);
+
+	grecs_symtab_foreach(watchconf_new, watchconf_install, &setup);
+
+	grecs_symtab_free(watchconf_tab);
+	watchconf_tab = watchconf_new;
+	watchconf_new = NULL;
+
+	if (grecs_symtab_count(nametab) == 0) {
+		diag(LOG_CRIT, _("no watchers left; exiting now"));
+		stop = 1;
+	}
+	return 0;
+}
+
+
 char *
 split_pathname(struct watchpoint *dp, char **dirname)
 {
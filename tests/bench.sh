@@ -0,0 +1,223 @@
+#! /bin/sh
+# bench.sh - performance benchmark for GNU direvent
+# Copyright (C) 2021 Sergey Poznyakoff
+#
+# GNU direvent is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3, or (at your option)
+# any later version.
+#
+# GNU direvent is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with GNU direvent.  If not, see <http://www.gnu.org/licenses/>.
+
+# The benchmark is controlled by the following environment variables:
+#
+#   DIREVENT       direvent binary to test
+#   LOADGEN        load generator binary
+#   BENCH_DEPTH    depth of the test directory tree
+#   BENCH_WIDTH    number of subdirectories at each tree level
+#   BENCH_FILES    number of files to run through create/modify/rename/delete
+#   BENCH_RATE     operations per second (0 means as fast as possible)
+#   BENCH_CRAWL_FILES
+#                  number of files in the tree used to time the crawl
+#   BENCH_DIR      directory to create the test trees in
+#   BENCH_OUTPUT   name of the output file (JSON)
+#
+# To see how directory scanning performs on the storage of interest,
+# point BENCH_DIR at it, e.g. a tmpfs or a file system on a loop device
+# throttled with dm-delay, and compare the "crawl" results of a build
+# against one configured with ac_cv_func_fstatat=no, which stats each
+# entry by its full pathname.
+
+: ${DIREVENT:=direvent}
+: ${LOADGEN:=loadgen}
+: ${BENCH_DEPTH:=3}
+: ${BENCH_WIDTH:=8}
+: ${BENCH_FILES:=2000}
+: ${BENCH_RATE:=1000}
+: ${BENCH_CRAWL_FILES:=20000}
+: ${BENCH_OUTPUT:=bench.json}
+
+workdir=`mktemp -d ${BENCH_DIR:-${TMPDIR:-/tmp}}/direvent-bench.XXXXXX` || exit 1
+pid=
+trap 'test -n "$pid" && kill $pid 2>/dev/null; rm -rf $workdir' 0 1 2 13 15
+
+# Current time in milliseconds, by the clock used in trace files
+now_ms() {
+    $LOADGEN -t
+}
+
+# Resident set size of the process $1, in kilobytes
+rss_kb() {
+    if test -r /proc/$1/status; then
+	awk '/^VmRSS:/ { print $2 }' /proc/$1/status
+    else
+	ps -o rss= -p $1 | tr -d ' '
+    fi
+}
+
+# start_direvent NAME PATH [ARGS...]
+# Start direvent watching PATH with the handler counting events.  Adds
+# $watcher_extra to the watcher statement.
+# Sets pid and startup (time to startup in milliseconds).
+watcher_extra=
+start_direvent() {
+    name=$1
+    path=$2
+    shift 2
+    cat > $workdir/$name.conf <<EOF
+trace-file "$workdir/$name.trace";
+watcher {
+    path $path $*;
+    $watcher_extra
+    event (create, write, delete);
+    command "/bin/true";
+    option (nowait);
+    timeout 60;
+}
+EOF
+    : > $workdir/$name.log
+    start=`now_ms`
+    $DIREVENT -f -l info $workdir/$name.conf 2>$workdir/$name.log &
+    pid=$!
+    while ! grep -q 'started' $workdir/$name.log; do
+	if ! kill -0 $pid 2>/dev/null; then
+	    echo >&2 "$0: direvent failed to start; see below:"
+	    cat >&2 $workdir/$name.log
+	    exit 1
+	fi
+	sleep 0.05
+    done
+    startup=$((`now_ms` - start))
+}
+
+stop_direvent() {
+    kill $pid
+    wait $pid 2>/dev/null
+    pid=
+}
+
+# Count handler runs recorded in the trace file $1
+handler_runs() {
+    grep -c '"cat":"handler"' $1
+}
+
+# Wait until the number of handler runs in trace file $1 stops changing.
+drain() {
+    prev=-1
+    cur=`handler_runs $1`
+    while test $cur -ne $prev; do
+	sleep 1
+	prev=$cur
+	cur=`handler_runs $1`
+    done
+}
+
+# Print the time (ms) when the last handler run recorded in trace file
+# $1 finished.
+last_exit_ms() {
+    awk -F'"ts":' '/"cat":"handler"/ {
+	  split($NF, a, /[,}]/); ts = a[1]
+	  n = split($0, b, /"dur":/); dur = b[n] + 0
+	  if (ts + dur > max) max = ts + dur
+	}
+	END { printf "%d", max / 1000 }' $1
+}
+
+# Print average and maximum dispatch latency (us) from trace file $1
+# as a JSON fragment.  Dispatch latency is the time from reading the
+# event to starting its handler, not the end-to-end latency.
+latency() {
+    awk -F'"dur":' '/"name":"dispatch"/ {
+	  d = $2 + 0; sum += d; n++; if (d > max) max = d
+	}
+	END {
+	  printf "\"avg_us\": %d, \"max_us\": %d",
+		 n ? sum / n : 0, max
+	}' $1
+}
+
+# 1. Baseline: a single empty directory
+mkdir $workdir/empty
+start_direvent baseline $workdir/empty
+rss_base=`rss_kb $pid`
+stop_direvent
+
+# 2. Startup crawl of a recursive tree
+mkdir $workdir/tree
+tree=`$LOADGEN -T -d $BENCH_DEPTH -w $BENCH_WIDTH $workdir/tree` || exit 1
+ndirs=`echo "$tree" | sed 's/.*"dirs": \([0-9]*\).*/\1/'`
+start_direvent tree $workdir/tree recursive
+crawl=$startup
+rss_tree=`rss_kb $pid`
+mem_per_wp=$(( (rss_tree - rss_base) * 1024 / (ndirs + 1) ))
+
+# 3. Throughput and dispatch latency at the requested rate.  The elapsed
+# time runs from the start of the load to the end of the last handler
+# run, so the time drain spends waiting for quiescence is not counted.
+start=`now_ms`
+load=`$LOADGEN -d $BENCH_DEPTH -w $BENCH_WIDTH -n $BENCH_FILES -r $BENCH_RATE $workdir/tree` || exit 1
+drain $workdir/tree.trace
+runs=`handler_runs $workdir/tree.trace`
+total_ms=$((`last_exit_ms $workdir/tree.trace` - start))
+lat=`latency $workdir/tree.trace`
+overflow=`grep -c 'event queue overflow' $workdir/tree.log`
+stop_direvent
+
+# 4. Overflow threshold: run as fast as possible
+mkdir $workdir/flood
+start_direvent flood $workdir/flood
+flood=`$LOADGEN -d 0 -n $BENCH_FILES -r 0 $workdir/flood` || exit 1
+drain $workdir/flood.trace
+flood_rate=`echo "$flood" | sed 's/.*"rate": \([0-9.]*\).*/\1/'`
+flood_runs=`handler_runs $workdir/flood.trace`
+flood_overflow=`grep -c 'event queue overflow' $workdir/flood.log`
+stop_direvent
+
+# 5. Startup crawl of a tree with files, by kernel watches and by polling
+mkdir $workdir/files
+$LOADGEN -d $BENCH_DEPTH -w $BENCH_WIDTH -n $BENCH_CRAWL_FILES -r 0 -o create \
+	 $workdir/files >/dev/null || exit 1
+start_direvent files $workdir/files recursive
+crawl_files=$startup
+stop_direvent
+watcher_extra="backend poll;"
+start_direvent filespoll $workdir/files recursive
+crawl_poll=$startup
+stop_direvent
+watcher_extra=
+
+cat > $BENCH_OUTPUT <<EOF
+{
+  "parameters": {
+    "depth": $BENCH_DEPTH, "width": $BENCH_WIDTH,
+    "files": $BENCH_FILES, "rate": $BENCH_RATE
+  },
+  "startup": {
+    "directories": $ndirs, "crawl_ms": $crawl,
+    "rss_baseline_kb": $rss_base, "rss_kb": $rss_tree,
+    "bytes_per_watchpoint": $mem_per_wp
+  },
+  "throughput": {
+    "load": $load,
+    "handler_runs": $runs, "elapsed_ms": $total_ms,
+    "events_per_sec": `awk -v n=$runs -v t=$total_ms 'BEGIN { printf "%.1f", t ? n * 1000 / t : 0 }'`,
+    "dispatch_latency": { $lat },
+    "overflows": $overflow
+  },
+  "flood": {
+    "load_rate": $flood_rate, "handler_runs": $flood_runs,
+    "overflows": $flood_overflow
+  },
+  "crawl": {
+    "files": $BENCH_CRAWL_FILES, "directories": $ndirs,
+    "kernel_ms": $crawl_files, "poll_ms": $crawl_poll
+  }
+}
+EOF
+cat $BENCH_OUTPUT
@@ -0,0 +1,321 @@
+/* loadgen.c - synthetic file system load generator
+   This file is part of GNU direvent testsuite.
+   Copyright (C) 2021 Sergey Poznyakoff
+
+   GNU direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   GNU direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Usage: loadgen [-T] [-d DEPTH] [-w WIDTH] [-n COUNT] [-r RATE]
+ *                [-o OPS] [-s SIZE] DIR
+ *        loadgen -t
+ *
+ * Creates a tree of directories of the given DEPTH under DIR, each level
+ * having WIDTH subdirectories.  Unless -T is given, then runs COUNT files
+ * through the sequence of operations OPS (a comma-separated list of:
+ * create, modify, rename, delete) in the leaf directories, performing at
+ * most RATE operations per second (0 means unlimited).  Created files
+ * are SIZE bytes long.
+ *
+ * On success, prints a JSON object describing the work done.
+ *
+ * With -t, prints the current CLOCK_MONOTONIC time in milliseconds, the
+ * clock used for the timestamps in direvent trace files, and exits.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+char *progname;
+unsigned depth = 1;
+unsigned width = 4;
+unsigned long count = 1000;
+unsigned long rate;
+size_t size = 128;
+int tree_only;
+
+enum {
+	OP_CREATE = 0x1,
+	OP_MODIFY = 0x2,
+	OP_RENAME = 0x4,
+	OP_DELETE = 0x8
+};
+
+int ops = OP_CREATE|OP_MODIFY|OP_RENAME|OP_DELETE;
+
+char **leafv;
+size_t leafc, leafn;
+unsigned long ndirs;
+unsigned long nops;
+
+static char *buffer;
+
+void
+usage(FILE *fp)
+{
+	fprintf(fp,
+		"usage: %s [-T] [-d DEPTH] [-w WIDTH] [-n COUNT] [-r RATE] "
+		"[-o OPS] [-s SIZE] DIR\n"
+		"       %s -t\n",
+		progname, progname);
+}
+
+static unsigned long
+numarg(char const *arg)
+{
+	char *p;
+	unsigned long n;
+
+	errno = 0;
+	n = strtoul(arg, &p, 10);
+	if (errno || *p) {
+		fprintf(stderr, "%s: invalid number: %s\n", progname, arg);
+		exit(2);
+	}
+	return n;
+}
+
+static int
+opsarg(char *arg)
+{
+	int res = 0;
+	char *s;
+
+	for (s = strtok(arg, ","); s; s = strtok(NULL, ",")) {
+		if (strcmp(s, "create") == 0)
+			res |= OP_CREATE;
+		else if (strcmp(s, "modify") == 0)
+			res |= OP_MODIFY;
+		else if (strcmp(s, "rename") == 0)
+			res |= OP_RENAME;
+		else if (strcmp(s, "delete") == 0)
+			res |= OP_DELETE;
+		else {
+			fprintf(stderr, "%s: unknown operation: %s\n",
+				progname, s);
+			exit(2);
+		}
+	}
+	return res;
+}
+
+static char *
+mkpath(char const *dir, char const *fmt, unsigned long n)
+{
+	size_t len = strlen(dir) + 32;
+	char *p = malloc(len);
+	if (!p) {
+		perror("malloc");
+		exit(1);
+	}
+	snprintf(p, len, "%s/", dir);
+	snprintf(p + strlen(p), len - strlen(p), fmt, n);
+	return p;
+}
+
+static void
+addleaf(char *dir)
+{
+	if (leafc == leafn) {
+		leafn = leafn ? 2 * leafn : 64;
+		leafv = realloc(leafv, leafn * sizeof(leafv[0]));
+		if (!leafv) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	leafv[leafc++] = dir;
+}
+
+static void
+mktree(char *dir, unsigned level)
+{
+	unsigned i;
+
+	if (level == depth) {
+		addleaf(dir);
+		return;
+	}
+	for (i = 0; i < width; i++) {
+		char *sub = mkpath(dir, "d%lu", i);
+		if (mkdir(sub, 0755) && errno != EEXIST) {
+			perror(sub);
+			exit(1);
+		}
+		ndirs++;
+		mktree(sub, level + 1);
+	}
+	if (level > 0)
+		free(dir);
+}
+
+static void
+throttle(struct timespec const *start)
+{
+	struct timespec now, when;
+	unsigned long long due;
+
+	if (rate == 0)
+		return;
+	/* Time (in ns since start) when the next operation is due */
+	due = (unsigned long long) nops * 1000000000ULL / rate;
+	when.tv_sec = start->tv_sec + due / 1000000000ULL;
+	when.tv_nsec = start->tv_nsec + due % 1000000000ULL;
+	if (when.tv_nsec >= 1000000000L) {
+		when.tv_sec++;
+		when.tv_nsec -= 1000000000L;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec < when.tv_sec
+	    || (now.tv_sec == when.tv_sec && now.tv_nsec < when.tv_nsec))
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL);
+}
+
+static void
+writefile(char const *name, int flags)
+{
+	int fd = open(name, O_WRONLY|flags, 0644);
+	if (fd == -1) {
+		perror(name);
+		exit(1);
+	}
+	if (write(fd, buffer, size) != size) {
+		perror(name);
+		exit(1);
+	}
+	close(fd);
+}
+
+static void
+runfile(unsigned long n, struct timespec const *start)
+{
+	char *dir = leafv[n % leafc];
+	char *name = mkpath(dir, "f%lu", n);
+	char *newname = mkpath(dir, "r%lu", n);
+	char *cur = name;
+
+	if (ops & OP_CREATE) {
+		throttle(start);
+		writefile(cur, O_CREAT|O_TRUNC);
+		nops++;
+	}
+	if (ops & OP_MODIFY) {
+		throttle(start);
+		writefile(cur, O_CREAT|O_APPEND);
+		nops++;
+	}
+	if (ops & OP_RENAME) {
+		throttle(start);
+		if (rename(cur, newname)) {
+			perror(cur);
+			exit(1);
+		}
+		cur = newname;
+		nops++;
+	}
+	if (ops & OP_DELETE) {
+		throttle(start);
+		if (unlink(cur)) {
+			perror(cur);
+			exit(1);
+		}
+		nops++;
+	}
+	free(name);
+	free(newname);
+}
+
+int
+main(int argc, char **argv)
+{
+	int c;
+	unsigned long i;
+	struct timespec start, end;
+	double elapsed;
+
+	progname = argv[0];
+	while ((c = getopt(argc, argv, "d:hn:o:r:s:tTw:")) != EOF) {
+		switch (c) {
+		case 'd':
+			depth = numarg(optarg);
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		case 'n':
+			count = numarg(optarg);
+			break;
+		case 'o':
+			ops = opsarg(optarg);
+			break;
+		case 'r':
+			rate = numarg(optarg);
+			break;
+		case 's':
+			size = numarg(optarg);
+			break;
+		case 't':
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			printf("%llu\n",
+			       (unsigned long long) start.tv_sec * 1000
+			       + start.tv_nsec / 1000000);
+			return 0;
+		case 'T':
+			tree_only = 1;
+			break;
+		case 'w':
+			width = numarg(optarg);
+			break;
+		default:
+			usage(stderr);
+			return 2;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc != 1) {
+		usage(stderr);
+		return 2;
+	}
+
+	buffer = malloc(size ? size : 1);
+	if (!buffer) {
+		perror("malloc");
+		return 1;
+	}
+	memset(buffer, 'x', size);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	mktree(argv[0], 0);
+	if (!tree_only) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < count; i++)
+			runfile(i, &start);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec)
+		  + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("{\"dirs\": %lu, \"leaves\": %lu, \"files\": %lu, "
+	       "\"ops\": %lu, \"elapsed\": %.6f, \"rate\": %.1f}\n",
+	       ndirs, (unsigned long) leafc, tree_only ? 0 : count, nops,
+	       elapsed, elapsed > 0 ? nops / elapsed : 0.0);
+	return 0;
+}